@@ -1,12 +1,69 @@
+use std::collections::HashMap;
 use std::env;
+use std::fmt::Write;
+use std::fs;
 use std::path::Path;
 
+/// Grapheme_Cluster_Break values, in the order of `GraphemeBreak` in src/objcpp/unicode.h.
+const GRAPHEME_BREAKS: [&str; 14] = [
+    "Other",
+    "CR",
+    "LF",
+    "Control",
+    "Extend",
+    "ZWJ",
+    "Regional_Indicator",
+    "Prepend",
+    "SpacingMark",
+    "L",
+    "V",
+    "T",
+    "LV",
+    "LVT",
+];
+
 fn main() {
     let dest = env::var("OUT_DIR").unwrap();
 
+    generate_unicode_tables(&Path::new(&dest).join("unicode_tables.h"));
+
     println!("cargo:rerun-if-changed=src/objcpp/");
-    let src = ["src/objcpp/renderer.mm"];
-    cc::Build::new().cpp(true).flag("-std=c++17").files(src.iter()).compile("objcpp");
+    let src = [
+        "src/objcpp/atlas.mm",
+        "src/objcpp/batch.mm",
+        "src/objcpp/byte_ring.mm",
+        "src/objcpp/emoji_cache.mm",
+        "src/objcpp/epoch_reclaimer.mm",
+        "src/objcpp/font_file.mm",
+        "src/objcpp/font_index.mm",
+        "src/objcpp/font_loader.mm",
+        "src/objcpp/frame_capture.mm",
+        "src/objcpp/glyph_cache.mm",
+        "src/objcpp/glyph_uploader.mm",
+        "src/objcpp/grid.mm",
+        "src/objcpp/image_cache.mm",
+        "src/objcpp/link_detector.mm",
+        "src/objcpp/pane_cache.mm",
+        "src/objcpp/pty_reader.mm",
+        "src/objcpp/rasterizer.mm",
+        "src/objcpp/renderer.mm",
+        "src/objcpp/row_cache.mm",
+        "src/objcpp/shader.mm",
+        "src/objcpp/shared_glyph_cache.mm",
+        "src/objcpp/startup_timeline.mm",
+        "src/objcpp/throughput_mode.mm",
+        "src/objcpp/unicode.mm",
+        "src/objcpp/utf8.mm",
+        "src/objcpp/wakeup.mm",
+    ];
+    cc::Build::new()
+        .cpp(true)
+        .flag("-std=c++17")
+        .include(&dest)
+        .files(src.iter())
+        .compile("objcpp");
+    println!("cargo:rustc-link-lib=framework=CoreText");
+    println!("cargo:rustc-link-lib=framework=ImageIO");
     let bindings = bindgen::Builder::default()
         .header("src/objcpp/wrapper.h")
         .clang_arg("-xobjective-c++")
@@ -16,3 +73,105 @@ fn main() {
         .write_to_file(Path::new(&dest).join("objcpp_bindings.rs"))
         .expect("Couldn't write bindings!");
 }
+
+/// Calls `assign` with every code point and value listed in a UCD data file.
+fn parse_ucd(path: &str, mut assign: impl FnMut(usize, &str)) {
+    println!("cargo:rerun-if-changed={path}");
+    let text = fs::read_to_string(path).expect("Couldn't read UCD data");
+    for line in text.lines() {
+        let line = line.split('#').next().unwrap().trim();
+        if line.is_empty() {
+            continue;
+        }
+
+        let (range, value) = line.split_once(';').expect("Malformed UCD line");
+        let range = range.trim();
+        let (start, end) = range.split_once("..").unwrap_or((range, range));
+        let start = usize::from_str_radix(start, 16).unwrap();
+        let end = usize::from_str_radix(end, 16).unwrap();
+        for c in start..=end {
+            assign(c, value.trim());
+        }
+    }
+}
+
+/// Generates constexpr three-stage lookup tables with one property byte per code point: the
+/// cell width in bits 0-1, the grapheme break property in bits 2-5 and Extended_Pictographic in
+/// bit 6.
+fn generate_unicode_tables(path: &Path) {
+    let mut wide = vec![false; 0x110000];
+    parse_ucd("extra/ucd/EastAsianWidth.txt", |c, value| wide[c] = value == "W" || value == "F");
+
+    let mut properties = vec![0u8; 0x110000];
+    parse_ucd("extra/ucd/GraphemeBreakProperty.txt", |c, value| {
+        let index = GRAPHEME_BREAKS.iter().position(|name| *name == value);
+        properties[c] = (index.expect("Unknown grapheme break property") as u8) << 2;
+    });
+    parse_ucd("extra/ucd/emoji-data.txt", |c, value| {
+        if value == "Extended_Pictographic" {
+            properties[c] |= 0x40;
+        }
+    });
+
+    // Code points that join the previous cell, or are not printed at all, take no width.
+    for (c, property) in properties.iter_mut().enumerate() {
+        *property |= match GRAPHEME_BREAKS[usize::from(*property >> 2 & 0xF)] {
+            "CR" | "LF" | "Control" | "Extend" | "ZWJ" | "V" | "T" => 0,
+            _ if wide[c] => 2,
+            _ => 1,
+        };
+    }
+
+    // Identical 64 code point leaves and 4096 code point blocks are stored once.
+    let mut leaves: Vec<&[u8]> = Vec::new();
+    let mut leaf_indices: HashMap<&[u8], u16> = HashMap::new();
+    let mut mids: Vec<Vec<u16>> = Vec::new();
+    let mut mid_indices: HashMap<Vec<u16>, u8> = HashMap::new();
+    let mut top = Vec::new();
+    for block in properties.chunks(4096) {
+        let mid: Vec<u16> = block
+            .chunks(64)
+            .map(|leaf| {
+                *leaf_indices.entry(leaf).or_insert_with(|| {
+                    leaves.push(leaf);
+                    (leaves.len() - 1) as u16
+                })
+            })
+            .collect();
+        let next = mids.len();
+        top.push(*mid_indices.entry(mid.clone()).or_insert_with(|| {
+            mids.push(mid);
+            next as u8
+        }));
+    }
+
+    let mut out = String::new();
+    out.push_str("// Generated by build.rs from extra/ucd. Do not edit.\n\n#pragma once\n\n");
+    out.push_str("#include <cstdint>\n\nnamespace unicode_tables {\n\n");
+    writeln!(out, "inline constexpr uint8_t kTop[{}] = {{", top.len()).unwrap();
+    write_rows(&mut out, &top);
+    out.push_str("};\n\n");
+    writeln!(out, "inline constexpr uint16_t kMid[{}][64] = {{", mids.len()).unwrap();
+    for mid in &mids {
+        out.push_str("    {\n");
+        write_rows(&mut out, mid);
+        out.push_str("    },\n");
+    }
+    out.push_str("};\n\n");
+    writeln!(out, "inline constexpr uint8_t kLeaf[{}][64] = {{", leaves.len()).unwrap();
+    for leaf in &leaves {
+        out.push_str("    {\n");
+        write_rows(&mut out, leaf);
+        out.push_str("    },\n");
+    }
+    out.push_str("};\n\n}\n");
+
+    fs::write(path, out).expect("Couldn't write Unicode tables!");
+}
+
+fn write_rows<T: std::fmt::Display>(out: &mut String, values: &[T]) {
+    for row in values.chunks(16) {
+        let row: Vec<String> = row.iter().map(ToString::to_string).collect();
+        writeln!(out, "        {},", row.join(", ")).unwrap();
+    }
+}
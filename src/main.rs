@@ -1,15 +1,18 @@
-use std::ffi::c_void;
+use std::ffi::{c_void, CString};
+use std::num::NonZeroU32;
+use std::time::{Duration, Instant};
 
-use winit::event::Event as WinitEvent;
-use winit::event_loop::{ControlFlow, EventLoop, EventLoopBuilder};
+use winit::event::{Event as WinitEvent, StartCause, WindowEvent};
+use winit::event_loop::{ControlFlow, EventLoop, EventLoopBuilder, EventLoopProxy};
 use winit::platform::run_return::EventLoopExtRunReturn;
 use winit::window::{Window, WindowBuilder};
 
+use glutin::config::GetGlConfig;
 use glutin::context::{
     ContextApi, ContextAttributesBuilder, NotCurrentGlContextSurfaceAccessor,
     PossiblyCurrentContext, PossiblyCurrentContextGlSurfaceAccessor, RawContext, Version,
 };
-use glutin::display::{Display, DisplayApiPreference};
+use glutin::display::{Display, DisplayApiPreference, GetGlDisplay};
 use glutin::prelude::*;
 use glutin::surface::{AsRawSurface, RawSurface, Surface, WindowSurface};
 
@@ -25,7 +28,9 @@ mod platform;
 include!(concat!(env!("OUT_DIR"), "/objcpp_bindings.rs"));
 
 fn main() {
+    mark_startup("launch");
     let window_event_loop = EventLoopBuilder::<Event>::with_user_event().build();
+    mark_startup("event loop");
     let processor = Processor::new(window_event_loop);
     processor.run();
 }
@@ -41,14 +46,24 @@ pub struct Processor {
 
 impl Processor {
     pub fn new(event_loop: EventLoop<Event>) -> Processor {
+        // Fonts load on worker threads while the display, window and context are created below.
+        let scale_factor =
+            event_loop.primary_monitor().map_or(1.0, |monitor| monitor.scale_factor());
+        unsafe { preload_fonts(scale_factor as f32) };
+
         let raw_display_handle = event_loop.raw_display_handle();
 
         #[cfg(not(windows))]
         let raw_window_handle = None;
 
+        // Background work in the renderer wakes the event loop through a proxy it never frees.
+        let proxy = Box::new(event_loop.create_proxy());
+        unsafe { set_wakeup_callback(Some(wake_event_loop), Box::into_raw(proxy).cast()) };
+
         let gl_display =
             unsafe { Display::new(raw_display_handle, DisplayApiPreference::Cgl).unwrap() };
         let gl_config = platform::pick_gl_config(&gl_display, raw_window_handle).unwrap();
+        mark_startup("display");
 
         let window_builder = WindowBuilder::new();
         let window = window_builder
@@ -57,6 +72,7 @@ impl Processor {
             .with_maximized(true)
             .build(&event_loop)
             .unwrap();
+        mark_startup("window");
 
         let profile = ContextAttributesBuilder::new()
             .with_context_api(ContextApi::OpenGl(Some(Version::new(3, 3))))
@@ -82,8 +98,18 @@ impl Processor {
         let surface =
             platform::create_gl_surface(&gl_context, viewport_size, window.raw_window_handle());
         let context = gl_context.make_current(&surface).unwrap();
+        mark_startup("context");
+
+        // Pay for shader compilation while the window is still hidden.
+        unsafe { prewarm_shaders() };
+        mark_startup("renderer ready");
 
         window.set_visible(true);
+        mark_startup("window shown");
+
+        if !unsafe { start_shell() } {
+            eprintln!("could not start the shell");
+        }
 
         Processor { event_loop, window, context, surface }
     }
@@ -100,18 +126,132 @@ impl Processor {
                     // raw_context.makeCurrentContext();
                 }
 
-                let _ = self.context.make_current(&self.surface);
+                make_context_current(&mut self.context, &self.surface);
 
-                unsafe {
-                    // cgl_context();
-                    draw();
-                }
-
-                let _ = &self.surface.swap_buffers(&self.context);
+                // cgl_context();
+                redraw(&self.surface, &self.context);
 
                 *control_flow = ControlFlow::Wait;
             },
+            WinitEvent::WindowEvent { event, .. } => match event {
+                WindowEvent::Resized(size) => {
+                    if let (Some(width), Some(height)) =
+                        (NonZeroU32::new(size.width), NonZeroU32::new(size.height))
+                    {
+                        self.surface.resize(&self.context, width, height);
+                        unsafe { resize(size.width, size.height) };
+                    }
+                    self.window.request_redraw();
+                },
+                WindowEvent::Focused(_) => self.window.request_redraw(),
+                _ => (),
+            },
+            WinitEvent::UserEvent(_) => {
+                // The window goes away with the shell.
+                if !unsafe { process_output() } {
+                    *control_flow = ControlFlow::Exit;
+                    return;
+                }
+                self.window.request_redraw();
+            },
+            WinitEvent::NewEvents(StartCause::ResumeTimeReached { .. }) => {
+                self.window.request_redraw()
+            },
+            WinitEvent::RedrawRequested(_) => {
+                make_context_current(&mut self.context, &self.surface);
+
+                // While output floods in, redraws are put off and drawn once the deadline passes.
+                let delay = unsafe { next_frame_delay_us() };
+                if delay > 0 {
+                    *control_flow =
+                        ControlFlow::WaitUntil(Instant::now() + Duration::from_micros(delay));
+                } else {
+                    redraw(&self.surface, &self.context);
+                    *control_flow = ControlFlow::Wait;
+                }
+            },
             _ => (),
         });
     }
 }
+
+fn mark_startup(phase: &str) {
+    let phase = CString::new(phase).unwrap();
+    unsafe { mark_startup_phase(phase.as_ptr()) };
+}
+
+unsafe extern "C" fn wake_event_loop(data: *mut c_void) {
+    let proxy = &*(data as *const EventLoopProxy<Event>);
+    let _ = proxy.send_event(Event {});
+}
+
+/// Makes `context` current again, or replaces it with a new one when it can't be, as after the
+/// driver lost it; the renderer then rebuilds its objects in the new context.
+fn make_context_current(context: &mut PossiblyCurrentContext, surface: &Surface<WindowSurface>) {
+    if context.is_current() || context.make_current(surface).is_ok() {
+        return;
+    }
+
+    let attributes = ContextAttributesBuilder::new()
+        .with_context_api(ContextApi::OpenGl(Some(Version::new(3, 3))))
+        .build(None);
+    let replacement = unsafe { context.display().create_context(&context.config(), &attributes) }
+        .and_then(|replacement| replacement.make_current(surface));
+    match replacement {
+        Ok(replacement) => {
+            *context = replacement;
+            unsafe { context_lost() };
+        },
+        Err(err) => eprintln!("could not recreate the GL context: {err}"),
+    }
+}
+
+fn redraw(surface: &Surface<WindowSurface>, context: &PossiblyCurrentContext) {
+    // Frames identical to the one on screen are neither drawn nor presented.
+    if unsafe { draw() } {
+        let _ = surface.swap_buffers(context);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::decode_utf8;
+
+    const REPLACEMENT: u32 = 0xFFFD;
+
+    fn decode(data: &[u8], chunk_sizes: &[usize]) -> Vec<u32> {
+        let mut out = vec![0; data.len()];
+        let count = unsafe {
+            decode_utf8(
+                data.as_ptr(),
+                chunk_sizes.as_ptr().cast(),
+                chunk_sizes.len() as _,
+                out.as_mut_ptr(),
+                out.len() as _,
+            )
+        };
+        out.truncate(count as usize);
+        out
+    }
+
+    /// Invalid prefixes split across chunks decode the same as in one chunk, one U+FFFD per byte.
+    #[test]
+    fn split_invalid_prefixes() {
+        let prefixes: [&[u8]; 4] =
+            [&[0xE0, 0x80], &[0xED, 0xA0], &[0xF0, 0x80, 0x80], &[0xF4, 0x90]];
+        for prefix in prefixes {
+            let data = [prefix, &b"yz"[..]].concat();
+            let mut expected = vec![REPLACEMENT; prefix.len()];
+            expected.extend([u32::from(b'y'), u32::from(b'z')]);
+
+            for cut in 0..=data.len() {
+                assert_eq!(
+                    decode(&data, &[cut, data.len() - cut]),
+                    expected,
+                    "{data:02X?} at {cut}"
+                );
+            }
+            assert_eq!(decode(&data, &vec![1; data.len()]), expected, "{data:02X?} bytewise");
+        }
+    }
+}
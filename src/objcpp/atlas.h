@@ -0,0 +1,110 @@
+#pragma once
+
+#include "glyph.h"
+#include <OpenGL/gl3.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A glyph's location in the atlas.
+struct Glyph {
+    // Index of the page holding the glyph, assigned by the owner of the pages.
+    uint16_t page;
+
+    int16_t left;
+    int16_t top;
+    int16_t width;
+    int16_t height;
+
+    float uv_left;
+    float uv_bot;
+    float uv_width;
+    float uv_height;
+
+    // Ticket of the threaded upload that has to finish before the glyph is sampled, or 0 when it
+    // was uploaded on the render thread.
+    uint64_t upload = 0;
+};
+
+// Where in which texture a reserved glyph goes.
+struct AtlasRegion {
+    GLuint texture;
+    GLint x;
+    GLint y;
+};
+
+// A texture page that glyphs are packed into on shelves. Coverage masks and color bitmaps share
+// the page; which shader variant samples a glyph decides how its texels are read.
+//
+// Glyph heights are rounded up to a handful of shelf heights, each with one open shelf that
+// glyphs claim horizontal space on with a compare-and-swap, so any number of threads can reserve
+// space at once. Only opening a shelf, once one fills up, takes a lock.
+//
+// Every inserted bitmap is also kept in a run-length encoded CPU shadow, so when the GL context is
+// lost or replaced the page can be rebuilt by decompressing and uploading it instead of
+// rasterizing every glyph again.
+class Atlas {
+public:
+    explicit Atlas(GLsizei size = 1024);
+    ~Atlas();
+
+    Atlas(const Atlas&) = delete;
+    Atlas& operator=(const Atlas&) = delete;
+
+    // Copies `glyph` into the page. Returns false when it has no room left for it.
+    bool insert(const RasterizedGlyph& glyph, Glyph* out);
+
+    // Places `glyph` and records it in the shadow like `insert`, but leaves uploading it into
+    // `region` to the caller. Safe to call from several threads at once.
+    bool reserve(const RasterizedGlyph& glyph, Glyph* out, AtlasRegion* region);
+
+    // Uploads `glyph` into a region returned by `reserve`. Works in any context sharing the
+    // page's texture.
+    static void upload(const AtlasRegion& region, const RasterizedGlyph& glyph);
+
+    // Forgets every glyph so the page can be filled again; texels are only replaced as new glyphs
+    // are uploaded over them. Not safe while other threads reserve space.
+    void clear();
+
+    // Recreates the texture in the current context from the shadow. The previous texture name is
+    // not deleted, since it belonged to a context that is gone.
+    void restore();
+
+    GLuint texture() const {
+        return tex_id;
+    }
+
+    // Bytes held by the compressed shadow, and by the bitmaps it stands for.
+    size_t shadow_size() const;
+    size_t raw_size() const;
+
+private:
+    struct ShadowEntry {
+        uint16_t x;
+        uint16_t y;
+        uint16_t width;
+        uint16_t height;
+        bool colored;
+        std::vector<uint8_t> data;
+        ShadowEntry* next;
+    };
+
+    bool open_shelf(std::atomic<uint64_t>& shelf, uint64_t full, GLsizei height);
+    void create_texture();
+
+    GLuint tex_id = 0;
+    GLsizei size;
+
+    // The open shelf of every shelf height, as its top edge in the upper and the left edge of its
+    // free space in the lower 32 bits, or `kNoShelf` before the first glyph of that height.
+    std::unique_ptr<std::atomic<uint64_t>[]> open_shelves;
+    // Top edge of the next shelf to open.
+    std::mutex shelf_mutex;
+    GLsizei next_shelf_y = 0;
+
+    // Pushed onto from every reserving thread, newest entry first.
+    std::atomic<ShadowEntry*> shadow{nullptr};
+};
@@ -0,0 +1,228 @@
+#import "atlas.h"
+#import <algorithm>
+#import <cstring>
+
+namespace {
+
+// Shelf heights are glyph heights rounded up to a multiple of this, trading a few rows of padding
+// for fewer shelves.
+constexpr GLsizei kShelfQuantum = 8;
+
+constexpr uint64_t kNoShelf = ~uint64_t(0);
+
+// PackBits style run-length encoding. A control byte below 128 is followed by that many plus one
+// literal bytes, any other control byte by a single byte repeated `control - 126` times. Glyph
+// bitmaps are mostly long runs of empty and fully covered pixels, so this shrinks them severalfold.
+std::vector<uint8_t> rle_encode(const uint8_t* data, size_t size) {
+    std::vector<uint8_t> out;
+    size_t i = 0;
+    while (i < size) {
+        size_t run = 1;
+        while (i + run < size && run < 129 && data[i + run] == data[i]) run++;
+        if (run >= 2) {
+            out.push_back(uint8_t(run + 126));
+            out.push_back(data[i]);
+            i += run;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < size && i - start < 128 && !(i + 1 < size && data[i] == data[i + 1])) i++;
+        out.push_back(uint8_t(i - start - 1));
+        out.insert(out.end(), data + start, data + i);
+    }
+    return out;
+}
+
+void rle_decode(const std::vector<uint8_t>& in, uint8_t* out, size_t size) {
+    size_t i = 0;
+    size_t o = 0;
+    while (i < in.size() && o < size) {
+        uint8_t control = in[i++];
+        if (control < 128) {
+            size_t length = std::min<size_t>(control + 1, size - o);
+            memcpy(out + o, &in[i], length);
+            i += control + 1;
+            o += length;
+        } else {
+            size_t length = std::min<size_t>(control - 126, size - o);
+            memset(out + o, in[i++], length);
+            o += length;
+        }
+    }
+}
+
+}
+
+Atlas::Atlas(GLsizei size)
+    : size(size),
+      open_shelves(new std::atomic<uint64_t>[(size + kShelfQuantum - 1) / kShelfQuantum]) {
+    for (GLsizei i = 0; i < (size + kShelfQuantum - 1) / kShelfQuantum; i++) {
+        open_shelves[i].store(kNoShelf, std::memory_order_relaxed);
+    }
+    create_texture();
+}
+
+Atlas::~Atlas() {
+    glDeleteTextures(1, &tex_id);
+    clear();
+}
+
+void Atlas::clear() {
+    ShadowEntry* entry = shadow.exchange(nullptr, std::memory_order_acq_rel);
+    while (entry) {
+        ShadowEntry* next = entry->next;
+        delete entry;
+        entry = next;
+    }
+
+    for (GLsizei i = 0; i < (size + kShelfQuantum - 1) / kShelfQuantum; i++) {
+        open_shelves[i].store(kNoShelf, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(shelf_mutex);
+    next_shelf_y = 0;
+}
+
+void Atlas::create_texture() {
+    glGenTextures(1, &tex_id);
+    glBindTexture(GL_TEXTURE_2D, tex_id);
+
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool Atlas::insert(const RasterizedGlyph& glyph, Glyph* out) {
+    AtlasRegion region;
+    if (!reserve(glyph, out, &region)) return false;
+    upload(region, glyph);
+    return true;
+}
+
+bool Atlas::reserve(const RasterizedGlyph& glyph, Glyph* out, AtlasRegion* region) {
+    if (glyph.width > size || glyph.height > size) return false;
+
+    GLsizei height = std::min(
+        (std::max<GLsizei>(glyph.height, 1) + kShelfQuantum - 1) / kShelfQuantum * kShelfQuantum,
+        size);
+    std::atomic<uint64_t>& shelf = open_shelves[(height - 1) / kShelfQuantum];
+
+    // Claiming space only moves the shelf's left edge, so a failed exchange just means another
+    // thread claimed space first.
+    uint64_t state = shelf.load(std::memory_order_acquire);
+    while (true) {
+        if (state != kNoShelf && uint32_t(state) + glyph.width <= uint32_t(size)) {
+            if (shelf.compare_exchange_weak(state, state + uint32_t(glyph.width),
+                                            std::memory_order_acq_rel,
+                                            std::memory_order_acquire)) {
+                break;
+            }
+            continue;
+        }
+        if (!open_shelf(shelf, state, height)) return false;
+        state = shelf.load(std::memory_order_acquire);
+    }
+
+    GLsizei offset_x = GLsizei(uint32_t(state));
+    GLsizei offset_y = GLsizei(state >> 32);
+
+    size_t bytes = size_t(glyph.width) * glyph.height * glyph.bytes_per_pixel();
+    ShadowEntry* entry = new ShadowEntry{uint16_t(offset_x),
+                                         uint16_t(offset_y),
+                                         uint16_t(glyph.width),
+                                         uint16_t(glyph.height),
+                                         glyph.colored,
+                                         rle_encode(glyph.buffer, bytes),
+                                         shadow.load(std::memory_order_relaxed)};
+    while (!shadow.compare_exchange_weak(entry->next, entry, std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+
+    *region = AtlasRegion{tex_id, offset_x, offset_y};
+    *out = Glyph{0,
+                 glyph.left,
+                 glyph.top,
+                 glyph.width,
+                 glyph.height,
+                 float(offset_x) / size,
+                 float(offset_y) / size,
+                 float(glyph.width) / size,
+                 float(glyph.height) / size};
+    return true;
+}
+
+void Atlas::upload(const AtlasRegion& region, const RasterizedGlyph& glyph) {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, region.texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, region.x, region.y, glyph.width, glyph.height,
+                    glyph.colored ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, glyph.buffer);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Replaces `shelf` with a new shelf below every other one, unless another thread already replaced
+// it since it was seen in state `full`. Returns false when the page has no room for it.
+bool Atlas::open_shelf(std::atomic<uint64_t>& shelf, uint64_t full, GLsizei height) {
+    std::lock_guard<std::mutex> lock(shelf_mutex);
+    if (shelf.load(std::memory_order_acquire) != full) return true;
+    if (height > size - next_shelf_y) return false;
+
+    shelf.store(uint64_t(next_shelf_y) << 32, std::memory_order_release);
+    next_shelf_y += height;
+    return true;
+}
+
+void Atlas::restore() {
+    // Coverage masks are expanded to opaque RGBA, as a GL_RGB upload would.
+    std::vector<uint8_t> page(size_t(size) * size * 4, 0);
+    std::vector<uint8_t> bitmap;
+    for (const ShadowEntry* node = shadow.load(std::memory_order_acquire); node;
+         node = node->next) {
+        const ShadowEntry& entry = *node;
+        size_t channels = entry.colored ? 4 : 3;
+        size_t row_size = size_t(entry.width) * channels;
+        bitmap.resize(row_size * entry.height);
+        rle_decode(entry.data, bitmap.data(), bitmap.size());
+
+        for (size_t row = 0; row < entry.height; row++) {
+            uint8_t* dest = &page[((entry.y + row) * size + entry.x) * 4];
+            const uint8_t* src = &bitmap[row * row_size];
+            if (entry.colored) {
+                memcpy(dest, src, row_size);
+                continue;
+            }
+            for (size_t x = 0; x < entry.width; x++) {
+                memcpy(dest + x * 4, src + x * 3, 3);
+                dest[x * 4 + 3] = 255;
+            }
+        }
+    }
+
+    create_texture();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, tex_id);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, page.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+size_t Atlas::shadow_size() const {
+    size_t bytes = 0;
+    for (const ShadowEntry* node = shadow.load(std::memory_order_acquire); node;
+         node = node->next) {
+        bytes += node->data.size();
+    }
+    return bytes;
+}
+
+size_t Atlas::raw_size() const {
+    size_t bytes = 0;
+    for (const ShadowEntry* node = shadow.load(std::memory_order_acquire); node;
+         node = node->next) {
+        bytes += size_t(node->width) * node->height * (node->colored ? 4 : 3);
+    }
+    return bytes;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "instance_data.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct DrawBucket {
+    uint16_t variant;
+    uint16_t atlas_page;
+
+    // Range of the bucket within the sorted instances.
+    uint32_t first;
+    uint32_t count;
+};
+
+// Groups instances by shader variant and atlas page with a stable counting sort, in
+// O(instances + variants * pages). Variants are the major key, so drawing the buckets in order
+// switches programs at most once per variant and textures at most once per page within it.
+void sort_instances(const std::vector<InstanceData>& instances, uint16_t page_count,
+                    std::vector<InstanceData>* sorted, std::vector<DrawBucket>* buckets);
@@ -0,0 +1,24 @@
+#import "batch.h"
+
+void sort_instances(const std::vector<InstanceData>& instances, uint16_t page_count,
+                    std::vector<InstanceData>* sorted, std::vector<DrawBucket>* buckets) {
+    size_t key_count = size_t(kVariantCount) * page_count;
+    auto key = [page_count](const InstanceData& instance) {
+        return size_t(instance.variant) * page_count + instance.atlas_page;
+    };
+
+    std::vector<uint32_t> offsets(key_count + 1, 0);
+    for (const InstanceData& instance : instances) offsets[key(instance) + 1]++;
+    for (size_t k = 0; k < key_count; k++) offsets[k + 1] += offsets[k];
+
+    buckets->clear();
+    for (size_t k = 0; k < key_count; k++) {
+        uint32_t count = offsets[k + 1] - offsets[k];
+        if (count == 0) continue;
+        buckets->push_back(
+            DrawBucket{uint16_t(k / page_count), uint16_t(k % page_count), offsets[k], count});
+    }
+
+    sorted->resize(instances.size());
+    for (const InstanceData& instance : instances) (*sorted)[offsets[key(instance)]++] = instance;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sys/uio.h>
+
+// A lock-free ring of bytes between one producer and one consumer thread.
+//
+// Both positions count up forever and are reduced to an offset only when indexing, so a full ring
+// is told apart from an empty one without a spare byte, and each side only ever writes its own
+// position. Free and queued bytes are handed out as up to two spans, the second one wrapping to the
+// start, shaped for `readv` on the producing side and read in place on the consuming one.
+class ByteRing {
+public:
+    // `capacity` has to be a power of two.
+    explicit ByteRing(size_t capacity);
+
+    ByteRing(const ByteRing&) = delete;
+    ByteRing& operator=(const ByteRing&) = delete;
+
+    // Producer side. Returns the free space and fills `spans` with it.
+    size_t writable(iovec spans[2]) const;
+    void commit_write(size_t bytes);
+
+    // Consumer side. Returns the queued bytes and fills `spans` with them.
+    size_t readable(iovec spans[2]) const;
+    void commit_read(size_t bytes);
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+private:
+    void spans(uint64_t position, size_t size, iovec out[2]) const;
+
+    std::unique_ptr<uint8_t[]> data;
+    size_t mask;
+
+    // On separate cache lines, so the two sides do not invalidate each other's writes.
+    alignas(64) std::atomic<uint64_t> read_position{0};
+    alignas(64) std::atomic<uint64_t> write_position{0};
+};
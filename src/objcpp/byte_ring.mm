@@ -0,0 +1,35 @@
+#import "byte_ring.h"
+#import <algorithm>
+
+ByteRing::ByteRing(size_t capacity) : data(new uint8_t[capacity]), mask(capacity - 1) {}
+
+void ByteRing::spans(uint64_t position, size_t size, iovec out[2]) const {
+    size_t offset = size_t(position) & mask;
+    size_t first = std::min(size, capacity() - offset);
+    out[0] = iovec{data.get() + offset, first};
+    out[1] = iovec{data.get(), size - first};
+}
+
+size_t ByteRing::writable(iovec out[2]) const {
+    uint64_t write = write_position.load(std::memory_order_relaxed);
+    size_t size = capacity() - size_t(write - read_position.load(std::memory_order_acquire));
+    spans(write, size, out);
+    return size;
+}
+
+void ByteRing::commit_write(size_t bytes) {
+    write_position.store(write_position.load(std::memory_order_relaxed) + bytes,
+                         std::memory_order_release);
+}
+
+size_t ByteRing::readable(iovec out[2]) const {
+    uint64_t read = read_position.load(std::memory_order_relaxed);
+    size_t size = size_t(write_position.load(std::memory_order_acquire) - read);
+    spans(read, size, out);
+    return size;
+}
+
+void ByteRing::commit_read(size_t bytes) {
+    read_position.store(read_position.load(std::memory_order_relaxed) + bytes,
+                        std::memory_order_release);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// A color glyph scaled to its final size.
+struct ColorBitmap {
+    int16_t left;
+    int16_t top;
+    int16_t width;
+    int16_t height;
+
+    // Premultiplied RGBA rows, top row first.
+    std::vector<uint8_t> pixels;
+};
+
+// Color emoji from the PNG strikes of a font's sbix table.
+//
+// Bitmaps are decoded on worker threads into premultiplied RGBA, box filtered down to the
+// requested height with the four channels of a pixel in one vector register, and cached by glyph
+// and height. Filtering after premultiplication keeps transparent texels from bleeding color into
+// the edges. The least recently used bitmaps are dropped once the cache exceeds its budget.
+class EmojiCache {
+public:
+    // `sbix` is the font's sbix table, retained for the lifetime of the cache. `on_ready` is
+    // invoked on a worker thread whenever a bitmap is ready to be collected.
+    EmojiCache(CFDataRef sbix, uint32_t glyph_count, std::function<void()> on_ready);
+    ~EmojiCache();
+
+    EmojiCache(const EmojiCache&) = delete;
+    EmojiCache& operator=(const EmojiCache&) = delete;
+
+    // Returns the bitmap of `glyph` at `height` pixels, or null while it is being decoded or when
+    // the font has none. The bitmap stays valid until the next `collect`.
+    const ColorBitmap* get(uint16_t glyph, uint16_t height);
+
+    // Returns true once the font turned out to have no bitmap of `glyph` at `height`.
+    bool missing(uint16_t glyph, uint16_t height) const;
+
+    // Takes in finished bitmaps and evicts over budget. Returns true when new bitmaps arrived.
+    bool collect();
+
+    uint64_t decoded() const {
+        return decoded_count;
+    }
+
+private:
+    enum class State {
+        kDecoding,
+        kReady,
+        kMissing,
+    };
+
+    struct Entry {
+        State state = State::kDecoding;
+        ColorBitmap bitmap;
+        uint64_t last_used = 0;
+    };
+
+    struct Job {
+        uint16_t glyph;
+        uint16_t height;
+    };
+
+    struct Result {
+        uint32_t key;
+        bool found;
+        ColorBitmap bitmap;
+    };
+
+    static uint32_t key(uint16_t glyph, uint16_t height) {
+        return uint32_t(glyph) << 16 | height;
+    }
+
+    bool render(uint16_t glyph, uint16_t height, ColorBitmap* out) const;
+    void decode_loop();
+
+    CFDataRef sbix;
+    uint32_t glyph_count;
+
+    std::unordered_map<uint32_t, Entry> entries;
+    size_t resident_bytes = 0;
+    uint64_t frame = 0;
+    uint64_t decoded_count = 0;
+
+    std::function<void()> on_ready;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<Job> jobs;
+    std::vector<Result> results;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
@@ -0,0 +1,401 @@
+#import "emoji_cache.h"
+#import <CoreGraphics/CoreGraphics.h>
+#import <ImageIO/ImageIO.h>
+#import <algorithm>
+#import <cmath>
+#import <cstring>
+
+#if defined(__ARM_NEON)
+#import <arm_neon.h>
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#endif
+
+namespace {
+
+// Scaled bitmaps kept around, about 2600 emoji at a 40 pixel cell height.
+constexpr size_t kBudgetBytes = 16 * 1024 * 1024;
+
+constexpr uint32_t kTagPng = 0x706E6720;  // 'png '
+constexpr uint32_t kTagDupe = 0x64757065; // 'dupe'
+
+uint16_t read_u16(const uint8_t* p) {
+    return uint16_t(p[0] << 8 | p[1]);
+}
+
+uint32_t read_u32(const uint8_t* p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+struct StrikeBitmap {
+    const uint8_t* png;
+    size_t size;
+    int16_t origin_x;
+    int16_t origin_y;
+};
+
+// Finds the PNG of `glyph` in the strike closest to `height`, preferring larger strikes so the
+// bitmap is only ever scaled down.
+bool find_bitmap(const uint8_t* table, size_t table_size, uint32_t glyph_count, uint16_t glyph,
+                 uint16_t height, StrikeBitmap* out) {
+    if (table_size < 8 || glyph >= glyph_count) return false;
+    uint32_t strike_count = read_u32(table + 4);
+    if (8 + size_t(strike_count) * 4 > table_size) return false;
+
+    size_t best = 0;
+    uint16_t best_ppem = 0;
+    for (uint32_t i = 0; i < strike_count; i++) {
+        size_t offset = read_u32(table + 8 + i * 4);
+        if (offset + 4 + (size_t(glyph_count) + 1) * 4 > table_size) continue;
+        uint16_t ppem = read_u16(table + offset);
+
+        bool better = best_ppem == 0 ||
+                      (ppem >= height ? best_ppem < height || ppem < best_ppem : ppem > best_ppem);
+        if (better) {
+            best = offset;
+            best_ppem = ppem;
+        }
+    }
+    if (best_ppem == 0) return false;
+
+    // A 'dupe' record reuses the bitmap of another glyph; one level of indirection is enough.
+    for (int hop = 0; hop < 2; hop++) {
+        const uint8_t* offsets = table + best + 4 + size_t(glyph) * 4;
+        size_t start = best + read_u32(offsets);
+        size_t end = best + read_u32(offsets + 4);
+        if (end <= start + 8 || end > table_size) return false;
+
+        const uint8_t* record = table + start;
+        uint32_t type = read_u32(record + 4);
+        if (type == kTagDupe && end - start >= 10) {
+            glyph = read_u16(record + 8);
+            if (glyph >= glyph_count) return false;
+            continue;
+        }
+        if (type != kTagPng) return false;
+
+        *out = StrikeBitmap{record + 8, end - start - 8, int16_t(read_u16(record)),
+                            int16_t(read_u16(record + 2))};
+        return true;
+    }
+    return false;
+}
+
+bool decode_png(const StrikeBitmap& bitmap, uint32_t* width, uint32_t* height,
+                std::vector<uint8_t>* pixels) {
+    CFDataRef data = CFDataCreateWithBytesNoCopy(nullptr, bitmap.png, bitmap.size,
+                                                 kCFAllocatorNull);
+    CGImageSourceRef source = CGImageSourceCreateWithData(data, nullptr);
+    CFRelease(data);
+    if (!source) return false;
+
+    CGImageRef image = CGImageSourceCreateImageAtIndex(source, 0, nullptr);
+    CFRelease(source);
+    if (!image) return false;
+
+    *width = CGImageGetWidth(image);
+    *height = CGImageGetHeight(image);
+    pixels->assign(size_t(*width) * *height * 4, 0);
+
+    CGColorSpaceRef color_space = CGColorSpaceCreateDeviceRGB();
+    CGContextRef context = CGBitmapContextCreate(
+        pixels->data(), *width, *height, 8, *width * 4, color_space,
+        kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big);
+    CGColorSpaceRelease(color_space);
+    if (context) {
+        CGContextDrawImage(context, CGRectMake(0, 0, *width, *height), image);
+        CGContextRelease(context);
+    }
+    CGImageRelease(image);
+    return context != nullptr;
+}
+
+// One RGBA pixel as four floats.
+#if defined(__ARM_NEON)
+using Pixel = float32x4_t;
+
+Pixel zero_pixel() {
+    return vdupq_n_f32(0.0f);
+}
+
+Pixel load_pixel(const uint8_t* p) {
+    uint32_t packed;
+    memcpy(&packed, p, 4);
+    uint16x8_t wide = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(packed)));
+    return vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide)));
+}
+
+Pixel load_pixel(const float* p) {
+    return vld1q_f32(p);
+}
+
+Pixel multiply_add(Pixel sum, Pixel pixel, float weight) {
+    return vmlaq_n_f32(sum, pixel, weight);
+}
+
+void store_pixel(float* p, Pixel pixel) {
+    vst1q_f32(p, pixel);
+}
+
+void store_pixel(uint8_t* p, Pixel pixel) {
+    uint16x4_t narrow = vqmovn_u32(vcvtq_u32_f32(vaddq_f32(pixel, vdupq_n_f32(0.5f))));
+    uint8x8_t bytes = vqmovn_u16(vcombine_u16(narrow, narrow));
+    vst1_lane_u32(reinterpret_cast<uint32_t*>(p), vreinterpret_u32_u8(bytes), 0);
+}
+#elif defined(__SSE2__)
+using Pixel = __m128;
+
+Pixel zero_pixel() {
+    return _mm_setzero_ps();
+}
+
+Pixel load_pixel(const uint8_t* p) {
+    int32_t packed;
+    memcpy(&packed, p, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i wide = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(wide, zero));
+}
+
+Pixel load_pixel(const float* p) {
+    return _mm_loadu_ps(p);
+}
+
+Pixel multiply_add(Pixel sum, Pixel pixel, float weight) {
+    return _mm_add_ps(sum, _mm_mul_ps(pixel, _mm_set1_ps(weight)));
+}
+
+void store_pixel(float* p, Pixel pixel) {
+    _mm_storeu_ps(p, pixel);
+}
+
+void store_pixel(uint8_t* p, Pixel pixel) {
+    __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(pixel), _mm_setzero_si128());
+    int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+    memcpy(p, &packed, 4);
+}
+#else
+struct Pixel {
+    float c[4];
+};
+
+Pixel zero_pixel() {
+    return Pixel{};
+}
+
+Pixel load_pixel(const uint8_t* p) {
+    return Pixel{{float(p[0]), float(p[1]), float(p[2]), float(p[3])}};
+}
+
+Pixel load_pixel(const float* p) {
+    return Pixel{{p[0], p[1], p[2], p[3]}};
+}
+
+Pixel multiply_add(Pixel sum, Pixel pixel, float weight) {
+    for (int i = 0; i < 4; i++) sum.c[i] += pixel.c[i] * weight;
+    return sum;
+}
+
+void store_pixel(float* p, Pixel pixel) {
+    memcpy(p, pixel.c, sizeof(pixel.c));
+}
+
+void store_pixel(uint8_t* p, Pixel pixel) {
+    for (int i = 0; i < 4; i++) p[i] = uint8_t(std::clamp(pixel.c[i] + 0.5f, 0.0f, 255.0f));
+}
+#endif
+
+// Source pixels an output pixel averages, weighted by how much of each it covers.
+struct Footprint {
+    size_t first;
+    std::vector<float> weights;
+};
+
+std::vector<Footprint> box_footprints(size_t source_size, size_t target_size) {
+    std::vector<Footprint> footprints(target_size);
+    double scale = double(source_size) / target_size;
+    for (size_t i = 0; i < target_size; i++) {
+        double start = i * scale;
+        double end = std::min((i + 1) * scale, double(source_size));
+        size_t first = size_t(start);
+        size_t last = std::min(size_t(std::ceil(end)), source_size);
+
+        Footprint& footprint = footprints[i];
+        footprint.first = first;
+        for (size_t p = first; p < last; p++) {
+            double covered = std::min(end, double(p + 1)) - std::max(start, double(p));
+            footprint.weights.push_back(float(covered / (end - start)));
+        }
+    }
+    return footprints;
+}
+
+// Box filters premultiplied RGBA, rows first and then columns.
+void downscale(const std::vector<uint8_t>& source, size_t source_width, size_t source_height,
+               size_t width, size_t height, std::vector<uint8_t>* out) {
+    std::vector<Footprint> columns = box_footprints(source_width, width);
+    std::vector<Footprint> rows = box_footprints(source_height, height);
+
+    std::vector<float> horizontal(width * source_height * 4);
+    for (size_t y = 0; y < source_height; y++) {
+        const uint8_t* row = &source[y * source_width * 4];
+        for (size_t x = 0; x < width; x++) {
+            const Footprint& footprint = columns[x];
+            Pixel sum = zero_pixel();
+            for (size_t i = 0; i < footprint.weights.size(); i++) {
+                sum = multiply_add(sum, load_pixel(row + (footprint.first + i) * 4),
+                                   footprint.weights[i]);
+            }
+            store_pixel(&horizontal[(y * width + x) * 4], sum);
+        }
+    }
+
+    out->resize(width * height * 4);
+    for (size_t y = 0; y < height; y++) {
+        const Footprint& footprint = rows[y];
+        for (size_t x = 0; x < width; x++) {
+            Pixel sum = zero_pixel();
+            for (size_t i = 0; i < footprint.weights.size(); i++) {
+                sum = multiply_add(sum,
+                                   load_pixel(&horizontal[((footprint.first + i) * width + x) * 4]),
+                                   footprint.weights[i]);
+            }
+            store_pixel(&(*out)[(y * width + x) * 4], sum);
+        }
+    }
+}
+
+}
+
+EmojiCache::EmojiCache(CFDataRef sbix, uint32_t glyph_count, std::function<void()> on_ready)
+    : sbix(static_cast<CFDataRef>(CFRetain(sbix))),
+      glyph_count(glyph_count),
+      on_ready(std::move(on_ready)) {
+    size_t thread_count = std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+    for (size_t i = 0; i < thread_count; i++) {
+        workers.emplace_back(&EmojiCache::decode_loop, this);
+    }
+}
+
+EmojiCache::~EmojiCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (std::thread& worker : workers) worker.join();
+    CFRelease(sbix);
+}
+
+const ColorBitmap* EmojiCache::get(uint16_t glyph, uint16_t height) {
+    auto [it, inserted] = entries.try_emplace(key(glyph, height));
+    Entry& entry = it->second;
+    if (inserted) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(Job{glyph, height});
+        }
+        condition.notify_one();
+        return nullptr;
+    }
+
+    if (entry.state != State::kReady) return nullptr;
+    entry.last_used = frame;
+    return &entry.bitmap;
+}
+
+bool EmojiCache::missing(uint16_t glyph, uint16_t height) const {
+    auto it = entries.find(key(glyph, height));
+    return it != entries.end() && it->second.state == State::kMissing;
+}
+
+bool EmojiCache::collect() {
+    frame++;
+
+    std::vector<Result> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.swap(results);
+    }
+
+    bool arrived = false;
+    for (Result& result : finished) {
+        Entry& entry = entries[result.key];
+        if (!result.found) {
+            entry.state = State::kMissing;
+            continue;
+        }
+        entry.state = State::kReady;
+        entry.bitmap = std::move(result.bitmap);
+        entry.last_used = frame;
+        resident_bytes += entry.bitmap.pixels.size();
+        decoded_count++;
+        arrived = true;
+    }
+
+    if (resident_bytes <= kBudgetBytes) return arrived;
+
+    // Drop the least recently used bitmaps down to three quarters of the budget, so eviction
+    // does not run again on the next frame.
+    std::vector<std::pair<uint64_t, uint32_t>> ready;
+    for (const auto& [entry_key, entry] : entries) {
+        if (entry.state == State::kReady) ready.emplace_back(entry.last_used, entry_key);
+    }
+    std::sort(ready.begin(), ready.end());
+    for (const auto& [last_used, ready_key] : ready) {
+        if (resident_bytes <= kBudgetBytes / 4 * 3) break;
+        auto it = entries.find(ready_key);
+        resident_bytes -= it->second.bitmap.pixels.size();
+        entries.erase(it);
+    }
+    return arrived;
+}
+
+bool EmojiCache::render(uint16_t glyph, uint16_t height, ColorBitmap* out) const {
+    StrikeBitmap strike_bitmap;
+    if (!find_bitmap(CFDataGetBytePtr(sbix), CFDataGetLength(sbix), glyph_count, glyph, height,
+                     &strike_bitmap)) {
+        return false;
+    }
+
+    uint32_t source_width = 0;
+    uint32_t source_height = 0;
+    std::vector<uint8_t> source;
+    if (!decode_png(strike_bitmap, &source_width, &source_height, &source) || !source_height) {
+        return false;
+    }
+
+    // Scaled to exactly the requested height, keeping the aspect ratio.
+    double scale = double(height) / source_height;
+    size_t width = std::max<size_t>(1, size_t(std::lround(source_width * scale)));
+    downscale(source, source_width, source_height, width, height, &out->pixels);
+
+    out->left = int16_t(std::lround(strike_bitmap.origin_x * scale));
+    out->top = int16_t(std::lround((strike_bitmap.origin_y + double(source_height)) * scale));
+    out->width = int16_t(width);
+    out->height = int16_t(height);
+    return true;
+}
+
+void EmojiCache::decode_loop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        Result result{key(job.glyph, job.height), false, {}};
+        result.found = render(job.glyph, job.height, &result.bitmap);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            results.push_back(std::move(result));
+        }
+        if (on_ready) on_ready();
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <OpenGL/gl3.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Defers reusing what drawn frames may still read until the GPU finished those frames.
+//
+// Every frame the render thread builds is an epoch. Whatever a frame reads is stamped with its
+// epoch, and ending the frame fences its commands. Retired objects are reclaimed once the fence of
+// the last epoch that read them has signalled, so nothing the GPU may still sample is overwritten,
+// and readers never synchronize with retiring threads beyond loading the epoch.
+class EpochReclaimer {
+public:
+    EpochReclaimer() = default;
+    ~EpochReclaimer();
+
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    // Starts the next frame. Render thread only.
+    void pin();
+    // Fences the commands of the pinned frame and reclaims what became safe. Render thread only.
+    void unpin();
+
+    // The epoch of the frame being built, or of the last one between frames.
+    uint64_t epoch() const {
+        return current_epoch.load(std::memory_order_acquire);
+    }
+
+    // Runs `reclaim` on the render thread once the frame of epoch `last_used` has completed. Safe
+    // to call from any thread.
+    void retire(uint64_t last_used, std::function<void()> reclaim);
+
+    // Reclaims what completed frames released, without blocking. Render thread only.
+    void collect();
+    // Blocks until the frame of epoch `epoch` completed on the GPU, then collects. Render thread
+    // only.
+    void wait(uint64_t epoch);
+
+    // Counts every frame as completed, since the fences went away with the context.
+    void context_lost();
+
+    // Times `wait` blocked on a fence.
+    uint64_t waits() const {
+        return wait_count;
+    }
+
+private:
+    struct Retired {
+        uint64_t last_used;
+        std::function<void()> reclaim;
+    };
+
+    void complete_front();
+
+    std::atomic<uint64_t> current_epoch{0};
+    std::atomic<uint64_t> completed_epoch{0};
+
+    // Fences of frames the GPU may still be executing, oldest first.
+    std::deque<std::pair<uint64_t, GLsync>> fences;
+    uint64_t wait_count = 0;
+
+    std::mutex mutex;
+    std::vector<Retired> retired;
+};
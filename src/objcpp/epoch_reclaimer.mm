@@ -0,0 +1,66 @@
+#import "epoch_reclaimer.h"
+#import <algorithm>
+#import <iterator>
+
+EpochReclaimer::~EpochReclaimer() {
+    for (auto& [epoch, fence] : fences) glDeleteSync(fence);
+}
+
+void EpochReclaimer::pin() {
+    current_epoch.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void EpochReclaimer::unpin() {
+    fences.emplace_back(epoch(), glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+    collect();
+}
+
+void EpochReclaimer::retire(uint64_t last_used, std::function<void()> reclaim) {
+    std::lock_guard<std::mutex> lock(mutex);
+    retired.push_back(Retired{last_used, std::move(reclaim)});
+}
+
+void EpochReclaimer::complete_front() {
+    completed_epoch.store(fences.front().first, std::memory_order_release);
+    glDeleteSync(fences.front().second);
+    fences.pop_front();
+}
+
+void EpochReclaimer::collect() {
+    // Frames complete in order, so the first pending fence bounds every later one.
+    while (!fences.empty()) {
+        GLenum status = glClientWaitSync(fences.front().second, 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED) break;
+        complete_front();
+    }
+
+    uint64_t completed = completed_epoch.load(std::memory_order_acquire);
+    std::vector<Retired> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto first_ready = std::partition(
+            retired.begin(), retired.end(),
+            [completed](const Retired& entry) { return entry.last_used > completed; });
+        std::move(first_ready, retired.end(), std::back_inserter(ready));
+        retired.erase(first_ready, retired.end());
+    }
+    for (Retired& entry : ready) entry.reclaim();
+}
+
+void EpochReclaimer::wait(uint64_t epoch) {
+    while (!fences.empty() && completed_epoch.load(std::memory_order_acquire) < epoch) {
+        if (glClientWaitSync(fences.front().second, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            wait_count++;
+            glClientWaitSync(fences.front().second, GL_SYNC_FLUSH_COMMANDS_BIT,
+                             GL_TIMEOUT_IGNORED);
+        }
+        complete_front();
+    }
+    collect();
+}
+
+void EpochReclaimer::context_lost() {
+    fences.clear();
+    completed_epoch.store(epoch(), std::memory_order_release);
+    collect();
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+constexpr uint32_t font_tag(const char (&name)[5]) {
+    return uint32_t(uint8_t(name[0])) << 24 | uint32_t(uint8_t(name[1])) << 16 |
+           uint32_t(uint8_t(name[2])) << 8 | uint32_t(uint8_t(name[3]));
+}
+
+// Bytes inside a mapped font file.
+struct FontData {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    explicit operator bool() const {
+        return data != nullptr;
+    }
+};
+
+// A TrueType or OpenType face, mapped read-only from its file.
+//
+// Every file is mapped once per process and shared by every window and thread that opens it. Only
+// the table directory is read on open; cmap is compiled on first use into a page table that maps
+// a codepoint to its glyph with two loads, and the rest of the file is handed to the rasterizer
+// as mapped, so a large CJK font only costs the pages that are actually touched. Nothing changes
+// after cmap is parsed, so all accessors are safe to call from any thread.
+class FontFile {
+public:
+    // Returns the face at `face_index` of the file at `path`, or `nullptr` when it can't be mapped
+    // or is not a font. Opening a face that is already open returns the same instance.
+    static std::shared_ptr<const FontFile> open(const std::string& path, uint32_t face_index = 0);
+
+    ~FontFile();
+
+    FontFile(const FontFile&) = delete;
+    FontFile& operator=(const FontFile&) = delete;
+
+    // Identifies the face across processes; changes when the file does.
+    uint64_t hash() const {
+        return face_hash;
+    }
+
+    uint32_t face_index() const {
+        return face;
+    }
+
+    // Returns the table with `tag`, or an empty span when the face has none.
+    FontData table(uint32_t tag) const;
+
+    // Returns name record `name_id` of the name table as UTF-8, preferring US English Unicode
+    // records, or an empty string when the face has none.
+    std::string name(uint16_t name_id) const;
+
+    // Returns the glyph `c` maps to, or 0 (.notdef) when the face has none.
+    uint32_t glyph_index(char32_t c) const;
+
+    // Whether any codepoint in [page * 256, page * 256 + 256) maps to a glyph.
+    bool covers_page(uint32_t page) const;
+
+    // The whole mapped file, for handing to a rasterizer without copying it.
+    FontData file() const {
+        return FontData{static_cast<const uint8_t*>(base), size};
+    }
+
+private:
+    struct TableRecord {
+        uint32_t tag;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    FontFile(uint32_t face_index, void* base, size_t size);
+
+    bool read_directory();
+    void parse_cmap() const;
+    void map_codepoint(uint32_t c, uint16_t glyph) const;
+
+    uint32_t face;
+    void* base;
+    size_t size;
+
+    uint64_t face_hash = 0;
+    std::vector<TableRecord> tables;
+    uint32_t glyphs = 0;
+
+    // The best Unicode subtable of cmap compiled into a two-level table: `cmap_top` holds the page
+    // of every 256 codepoints within `cmap_pages`, whose BMP pages are laid out densely in order.
+    mutable std::once_flag cmap_once;
+    mutable std::vector<uint16_t> cmap_top;
+    mutable std::vector<uint16_t> cmap_pages;
+};
@@ -0,0 +1,294 @@
+#import "font_file.h"
+#import "hash.h"
+#import <algorithm>
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+#import <unordered_map>
+
+namespace {
+
+constexpr uint32_t kCollectionTag = font_tag("ttcf");
+
+constexpr uint32_t kCodepointLimit = 0x110000;
+constexpr uint32_t kCmapPageSize = 256;
+constexpr uint32_t kBmpPages = 0x10000 / kCmapPageSize;
+// One entry per page of codepoints plus one for everything out of range.
+constexpr uint32_t kCmapTopSize = kCodepointLimit / kCmapPageSize + 1;
+// Shared by every page without a single mapped codepoint; it directly follows the BMP.
+constexpr uint16_t kEmptyPage = kBmpPages;
+
+uint16_t read_u16(const uint8_t* p) {
+    return uint16_t(p[0] << 8 | p[1]);
+}
+
+uint32_t read_u32(const uint8_t* p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+}
+
+std::shared_ptr<const FontFile> FontFile::open(const std::string& path, uint32_t face_index) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::weak_ptr<const FontFile>> open_faces;
+
+    std::string key = path + '#' + std::to_string(face_index);
+    std::lock_guard lock(mutex);
+    if (auto existing = open_faces[key].lock()) return existing;
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < 12) {
+        close(fd);
+        return nullptr;
+    }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return nullptr;
+
+    // Glyph lookups jump all over the outline tables, so read-ahead would mostly fault in pages
+    // that are never used.
+    madvise(base, st.st_size, MADV_RANDOM);
+
+    std::shared_ptr<FontFile> font(new FontFile(face_index, base, st.st_size));
+    if (!font->read_directory()) return nullptr;
+
+    // The hash keys glyphs in the cache shared between processes, so a font that was replaced on
+    // disk must not hit bitmaps rasterized from its old version.
+    uint64_t hash = hash_bytes(path.data(), path.size(), face_index);
+    hash = hash_combine(hash, uint64_t(st.st_size));
+    font->face_hash = hash_combine(hash, uint64_t(st.st_mtime));
+
+    open_faces[key] = font;
+    return font;
+}
+
+FontFile::FontFile(uint32_t face_index, void* base, size_t size)
+    : face(face_index), base(base), size(size) {}
+
+FontFile::~FontFile() {
+    munmap(base, size);
+}
+
+bool FontFile::read_directory() {
+    const auto* bytes = static_cast<const uint8_t*>(base);
+
+    size_t directory = 0;
+    if (read_u32(bytes) == kCollectionTag) {
+        uint32_t face_count = read_u32(bytes + 8);
+        if (face >= face_count || 12 + size_t(face + 1) * 4 > size) return false;
+        directory = read_u32(bytes + 12 + face * 4);
+    } else if (face != 0) {
+        return false;
+    }
+    if (directory + 12 > size) return false;
+
+    uint16_t table_count = read_u16(bytes + directory + 4);
+    if (directory + 12 + size_t(table_count) * 16 > size) return false;
+
+    tables.reserve(table_count);
+    for (uint16_t i = 0; i < table_count; i++) {
+        const uint8_t* record = bytes + directory + 12 + i * 16;
+        TableRecord entry{read_u32(record), read_u32(record + 8), read_u32(record + 12)};
+        if (size_t(entry.offset) + entry.length > size) continue;
+        tables.push_back(entry);
+    }
+
+    FontData head = table(font_tag("head"));
+    FontData maxp = table(font_tag("maxp"));
+    if (head.size < 54 || maxp.size < 6) return false;
+    glyphs = read_u16(maxp.data + 4);
+    return true;
+}
+
+FontData FontFile::table(uint32_t tag) const {
+    for (const TableRecord& record : tables) {
+        if (record.tag == tag) {
+            return FontData{static_cast<const uint8_t*>(base) + record.offset, record.length};
+        }
+    }
+    return {};
+}
+
+void FontFile::parse_cmap() const {
+    cmap_top.assign(kCmapTopSize, kEmptyPage);
+    for (uint32_t page = 0; page < kBmpPages; page++) cmap_top[page] = uint16_t(page);
+    cmap_pages.assign((kBmpPages + 1) * kCmapPageSize, 0);
+
+    FontData cmap_table = table(font_tag("cmap"));
+    if (cmap_table.size < 4) return;
+
+    uint16_t subtable_count = read_u16(cmap_table.data + 2);
+    if (4 + size_t(subtable_count) * 8 > cmap_table.size) return;
+
+    // Full repertoire subtables beat BMP-only ones; anything that isn't Unicode is ignored.
+    const uint8_t* cmap = nullptr;
+    size_t cmap_size = 0;
+    uint16_t cmap_format = 0;
+    for (uint16_t i = 0; i < subtable_count; i++) {
+        const uint8_t* record = cmap_table.data + 4 + i * 8;
+        uint16_t platform = read_u16(record);
+        uint16_t encoding = read_u16(record + 2);
+        uint32_t offset = read_u32(record + 4);
+        bool unicode = platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+        if (!unicode || size_t(offset) + 8 > cmap_table.size) continue;
+
+        const uint8_t* subtable = cmap_table.data + offset;
+        uint16_t format = read_u16(subtable);
+        size_t length = 0;
+        if (format == 12) {
+            length = read_u32(subtable + 4);
+            if (length < 16 || 16 + size_t(read_u32(subtable + 12)) * 12 > length) continue;
+        } else if (format == 4) {
+            length = read_u16(subtable + 2);
+            if (length < 16 || 16 + size_t(read_u16(subtable + 6)) * 4 > length) continue;
+        } else {
+            continue;
+        }
+        if (format <= cmap_format || offset + length > cmap_table.size) continue;
+
+        cmap = subtable;
+        cmap_size = length;
+        cmap_format = format;
+    }
+
+    if (cmap_format == 12) {
+        uint32_t group_count = read_u32(cmap + 12);
+        for (uint32_t i = 0; i < group_count; i++) {
+            const uint8_t* group = cmap + 16 + i * 12;
+            uint32_t start = read_u32(group);
+            uint32_t end = std::min(read_u32(group + 4), kCodepointLimit - 1);
+            uint32_t glyph = read_u32(group + 8);
+            for (uint32_t c = start; c <= end && glyph < glyphs; c++, glyph++) {
+                map_codepoint(c, uint16_t(glyph));
+            }
+        }
+    } else if (cmap_format == 4) {
+        uint32_t segments = read_u16(cmap + 6) / 2;
+        const uint8_t* end_codes = cmap + 14;
+        const uint8_t* start_codes = end_codes + segments * 2 + 2;
+        const uint8_t* deltas = start_codes + segments * 2;
+        const uint8_t* range_offsets = deltas + segments * 2;
+
+        for (uint32_t i = 0; i < segments; i++) {
+            uint32_t start = read_u16(start_codes + i * 2);
+            uint32_t end = read_u16(end_codes + i * 2);
+            uint16_t delta = read_u16(deltas + i * 2);
+            uint16_t range_offset = read_u16(range_offsets + i * 2);
+            for (uint32_t c = start; c <= end; c++) {
+                uint16_t glyph;
+                if (range_offset == 0) {
+                    glyph = uint16_t(c + delta);
+                } else {
+                    const uint8_t* entry = range_offsets + i * 2 + range_offset + (c - start) * 2;
+                    if (entry + 2 > cmap + cmap_size) break;
+                    glyph = read_u16(entry);
+                    if (glyph != 0) glyph = uint16_t(glyph + delta);
+                }
+                if (glyph < glyphs) map_codepoint(c, glyph);
+            }
+        }
+    }
+}
+
+void FontFile::map_codepoint(uint32_t c, uint16_t glyph) const {
+    // The first segment or group that covers a codepoint wins, as with a lookup in the subtable.
+    if (glyph == 0) return;
+    uint16_t& page = cmap_top[c / kCmapPageSize];
+    if (page == kEmptyPage) {
+        page = uint16_t(cmap_pages.size() / kCmapPageSize);
+        cmap_pages.resize(cmap_pages.size() + kCmapPageSize, 0);
+    }
+    uint16_t& entry = cmap_pages[size_t(page) * kCmapPageSize + c % kCmapPageSize];
+    if (entry == 0) entry = glyph;
+}
+
+uint32_t FontFile::glyph_index(char32_t c) const {
+    std::call_once(cmap_once, [this] { parse_cmap(); });
+
+    // Everything past the last codepoint lands on the trailing top entry, which is always empty.
+    uint32_t clamped = std::min(uint32_t(c), kCodepointLimit);
+    return cmap_pages[size_t(cmap_top[clamped / kCmapPageSize]) * kCmapPageSize +
+                      clamped % kCmapPageSize];
+}
+
+bool FontFile::covers_page(uint32_t page) const {
+    std::call_once(cmap_once, [this] { parse_cmap(); });
+    if (page >= kCmapTopSize - 1 || cmap_top[page] == kEmptyPage) return false;
+
+    const uint16_t* entries = cmap_pages.data() + size_t(cmap_top[page]) * kCmapPageSize;
+    return std::any_of(entries, entries + kCmapPageSize, [](uint16_t glyph) { return glyph != 0; });
+}
+
+std::string FontFile::name(uint16_t name_id) const {
+    FontData names = table(font_tag("name"));
+    if (names.size < 6) return {};
+    uint16_t count = read_u16(names.data + 2);
+    size_t storage = read_u16(names.data + 4);
+    if (6 + size_t(count) * 12 > names.size) return {};
+
+    // Windows US English first, then any other Unicode record, then Mac Roman.
+    const uint8_t* best = nullptr;
+    int best_rank = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        const uint8_t* record = names.data + 6 + i * 12;
+        if (read_u16(record + 6) != name_id) continue;
+        uint16_t platform = read_u16(record);
+        uint16_t encoding = read_u16(record + 2);
+        uint16_t language = read_u16(record + 4);
+        size_t end = storage + read_u16(record + 10) + read_u16(record + 8);
+        if (end > names.size) continue;
+
+        int rank = 0;
+        if (platform == 3 && (encoding == 1 || encoding == 10)) {
+            rank = language == 0x0409 ? 4 : 3;
+        } else if (platform == 0) {
+            rank = 2;
+        } else if (platform == 1 && encoding == 0) {
+            rank = 1;
+        }
+        if (rank > best_rank) {
+            best = record;
+            best_rank = rank;
+        }
+    }
+    if (!best) return {};
+
+    const uint8_t* text = names.data + storage + read_u16(best + 10);
+    size_t length = read_u16(best + 8);
+    std::string result;
+    if (best_rank == 1) {
+        // Names are ASCII in practice; anything else in Mac Roman is replaced.
+        for (size_t i = 0; i < length; i++) result += text[i] < 0x80 ? char(text[i]) : '?';
+        return result;
+    }
+
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        uint32_t c = read_u16(text + i);
+        if (c >= 0xD800 && c < 0xDC00 && i + 3 < length) {
+            uint32_t low = read_u16(text + i + 2);
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        if (c < 0x80) {
+            result += char(c);
+        } else if (c < 0x800) {
+            result += char(0xC0 | c >> 6);
+            result += char(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            result += char(0xE0 | c >> 12);
+            result += char(0x80 | (c >> 6 & 0x3F));
+            result += char(0x80 | (c & 0x3F));
+        } else {
+            result += char(0xF0 | c >> 18);
+            result += char(0x80 | (c >> 12 & 0x3F));
+            result += char(0x80 | (c >> 6 & 0x3F));
+            result += char(0x80 | (c & 0x3F));
+        }
+    }
+    return result;
+}
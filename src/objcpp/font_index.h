@@ -0,0 +1,56 @@
+#pragma once
+
+#include "font_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Installed fonts, indexed by name and by the codepoints they cover.
+//
+// The index lives in the user's cache directory and is mapped at startup. While none of the font
+// directories changed, opening it only stats those directories; otherwise they are listed again
+// and just the files that were added or modified are opened to read their names and coverage.
+// Coverage is kept as one bit per page of 256 codepoints, so fallback only opens faces that can
+// have a glyph for a codepoint.
+class FontIndex {
+public:
+    // Returns the process wide index, or `nullptr` when it could neither be loaded nor built.
+    static const FontIndex* open_default();
+
+    ~FontIndex();
+
+    FontIndex(const FontIndex&) = delete;
+    FontIndex& operator=(const FontIndex&) = delete;
+
+    // Returns the face of `family` in `style`, compared case-insensitively, or `nullptr` when it
+    // is not installed. An empty style picks the regular face, or else the first one.
+    std::shared_ptr<const FontFile> find(const std::string& family,
+                                         const std::string& style) const;
+
+    // Returns the first face that has a glyph for `c`, or `nullptr` when none does.
+    std::shared_ptr<const FontFile> fallback(char32_t c) const;
+
+    size_t face_count() const;
+
+private:
+    struct Header;
+    struct DirectoryRecord;
+    struct FaceRecord;
+
+    FontIndex(void* base, size_t size);
+
+    static FontIndex* load(const std::string& path);
+    static bool build(const std::string& path, const FontIndex* previous);
+
+    bool up_to_date() const;
+
+    const Header* header() const;
+    const DirectoryRecord* directories() const;
+    const FaceRecord* faces() const;
+    const char* string(uint32_t offset) const;
+
+    void* base;
+    size_t size;
+};
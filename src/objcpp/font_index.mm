@@ -0,0 +1,321 @@
+#import "font_index.h"
+#import <algorithm>
+#import <cstdio>
+#import <cstdlib>
+#import <cstring>
+#import <dirent.h>
+#import <fcntl.h>
+#import <strings.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+#import <unordered_map>
+
+namespace {
+
+constexpr uint32_t kMagic = 0x46495831;  // "FIX1"
+constexpr uint32_t kVersion = 1;
+
+// One bit for every page of 256 codepoints up to U+10FFFF.
+constexpr uint32_t kCoveragePages = 0x110000 / 256;
+constexpr size_t kCoverageBytes = kCoveragePages / 8;
+
+// Faces read from a single collection file at most.
+constexpr uint32_t kMaxCollectionFaces = 64;
+
+// Scanned in order, which is also the order fallback tries faces in.
+const char* const kFontDirectories[] = {
+    "~/Library/Fonts",
+    "/Library/Fonts",
+    "/System/Library/Fonts",
+};
+
+std::string expand_home(const char* path) {
+    if (path[0] != '~') return path;
+    const char* home = getenv("HOME");
+    return std::string(home ? home : "") + (path + 1);
+}
+
+// Modification time in seconds, or 0 when `path` doesn't exist.
+uint64_t modification_time(const std::string& path, uint64_t* size = nullptr) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) return 0;
+    if (size) *size = uint64_t(st.st_size);
+    return uint64_t(st.st_mtime);
+}
+
+bool is_font_file(const char* name) {
+    const char* extension = strrchr(name, '.');
+    if (!extension) return false;
+    return strcasecmp(extension, ".ttf") == 0 || strcasecmp(extension, ".otf") == 0 ||
+           strcasecmp(extension, ".ttc") == 0 || strcasecmp(extension, ".otc") == 0;
+}
+
+// Appends `directory` and every directory below it to `directories`, and the font files in them
+// to `files`, both sorted by name within each directory.
+void list_fonts(const std::string& directory, std::vector<std::string>* directories,
+                std::vector<std::string>* files) {
+    directories->push_back(directory);
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return;
+
+    std::vector<std::string> subdirectories;
+    std::vector<std::string> fonts;
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') continue;
+        std::string path = directory + '/' + entry->d_name;
+        if (entry->d_type == DT_DIR) {
+            subdirectories.push_back(path);
+        } else if (is_font_file(entry->d_name)) {
+            fonts.push_back(path);
+        }
+    }
+    closedir(dir);
+
+    std::sort(fonts.begin(), fonts.end());
+    std::sort(subdirectories.begin(), subdirectories.end());
+    files->insert(files->end(), fonts.begin(), fonts.end());
+    for (const std::string& subdirectory : subdirectories) {
+        list_fonts(subdirectory, directories, files);
+    }
+}
+
+// Builds the NUL separated string section of the index, storing every distinct string once.
+class StringPool {
+public:
+    uint32_t add(const std::string& value) {
+        auto [it, inserted] = offsets.emplace(value, uint32_t(data.size()));
+        if (inserted) data.append(value.c_str(), value.size() + 1);
+        return it->second;
+    }
+
+    const std::string& bytes() const {
+        return data;
+    }
+
+private:
+    std::string data;
+    std::unordered_map<std::string, uint32_t> offsets;
+};
+
+}
+
+struct FontIndex::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t directory_count;
+    uint32_t face_count;
+    uint64_t strings_size;
+};
+
+struct FontIndex::DirectoryRecord {
+    uint64_t modified;
+    uint32_t path;
+    uint32_t reserved;
+};
+
+struct FontIndex::FaceRecord {
+    uint64_t modified;
+    uint64_t file_size;
+    uint32_t path;
+    uint32_t face_index;
+    uint32_t family;
+    uint32_t style;
+    uint8_t coverage[kCoverageBytes];
+};
+
+const FontIndex* FontIndex::open_default() {
+    static FontIndex* index = [] {
+        std::string directory = expand_home("~/Library/Caches/glyph-atlas");
+        mkdir(directory.c_str(), 0755);
+        std::string path = directory + "/font-index";
+
+        FontIndex* loaded = load(path);
+        if (loaded && loaded->up_to_date()) return loaded;
+
+        bool built = build(path, loaded);
+        delete loaded;
+        return built ? load(path) : nullptr;
+    }();
+    return index;
+}
+
+FontIndex* FontIndex::load(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(Header)) {
+        close(fd);
+        return nullptr;
+    }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return nullptr;
+
+    auto* index = new FontIndex(base, st.st_size);
+    const Header* header = index->header();
+    size_t expected = sizeof(Header) + size_t(header->directory_count) * sizeof(DirectoryRecord) +
+                      size_t(header->face_count) * sizeof(FaceRecord) + header->strings_size;
+    if (header->magic != kMagic || header->version != kVersion || expected != size_t(st.st_size) ||
+        (header->strings_size > 0 &&
+         static_cast<const char*>(base)[st.st_size - 1] != '\0')) {
+        delete index;
+        return nullptr;
+    }
+    return index;
+}
+
+bool FontIndex::build(const std::string& path, const FontIndex* previous) {
+    std::vector<std::string> directories;
+    std::vector<std::string> files;
+    for (const char* root : kFontDirectories) list_fonts(expand_home(root), &directories, &files);
+
+    // Records of files that haven't changed are copied over instead of opening the file again.
+    std::unordered_map<std::string, std::vector<const FaceRecord*>> known;
+    if (previous) {
+        for (uint32_t i = 0; i < previous->header()->face_count; i++) {
+            const FaceRecord& face = previous->faces()[i];
+            known[previous->string(face.path)].push_back(&face);
+        }
+    }
+
+    StringPool strings;
+    std::vector<DirectoryRecord> directory_records;
+    for (const std::string& directory : directories) {
+        directory_records.push_back(
+            DirectoryRecord{modification_time(directory), strings.add(directory), 0});
+    }
+
+    std::vector<FaceRecord> face_records;
+    for (const std::string& file : files) {
+        uint64_t file_size = 0;
+        uint64_t modified = modification_time(file, &file_size);
+
+        auto it = known.find(file);
+        if (it != known.end() && it->second.front()->modified == modified &&
+            it->second.front()->file_size == file_size) {
+            for (const FaceRecord* face : it->second) {
+                FaceRecord record = *face;
+                record.path = strings.add(file);
+                record.family = strings.add(previous->string(face->family));
+                record.style = strings.add(previous->string(face->style));
+                face_records.push_back(record);
+            }
+            continue;
+        }
+
+        for (uint32_t face_index = 0; face_index < kMaxCollectionFaces; face_index++) {
+            std::shared_ptr<const FontFile> font = FontFile::open(file, face_index);
+            if (!font) break;
+
+            // Typographic names group more than the four styles of the legacy family names.
+            std::string family = font->name(16);
+            if (family.empty()) family = font->name(1);
+            std::string style = font->name(17);
+            if (style.empty()) style = font->name(2);
+
+            FaceRecord record = {};
+            record.modified = modified;
+            record.file_size = file_size;
+            record.path = strings.add(file);
+            record.face_index = face_index;
+            record.family = strings.add(family);
+            record.style = strings.add(style);
+            for (uint32_t page = 0; page < kCoveragePages; page++) {
+                if (font->covers_page(page)) record.coverage[page / 8] |= 1 << (page % 8);
+            }
+            face_records.push_back(record);
+        }
+    }
+
+    Header header = {kMagic, kVersion, uint32_t(directory_records.size()),
+                     uint32_t(face_records.size()), strings.bytes().size()};
+
+    // Written next to the index and renamed over it, so concurrently starting processes only ever
+    // map a complete index.
+    std::string temporary = path + '.' + std::to_string(getpid());
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (!out) return false;
+    bool written =
+        fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(directory_records.data(), sizeof(DirectoryRecord), directory_records.size(), out) ==
+            directory_records.size() &&
+        fwrite(face_records.data(), sizeof(FaceRecord), face_records.size(), out) ==
+            face_records.size() &&
+        fwrite(strings.bytes().data(), 1, strings.bytes().size(), out) == strings.bytes().size();
+    written = fclose(out) == 0 && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) == -1) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+FontIndex::FontIndex(void* base, size_t size) : base(base), size(size) {}
+
+FontIndex::~FontIndex() {
+    munmap(base, size);
+}
+
+bool FontIndex::up_to_date() const {
+    // Adding or removing a file or directory changes the modification time of its parent, and
+    // missing roots are recorded with a time of 0, so unchanged times mean an unchanged font set.
+    // Fonts replaced in place are not noticed until something else in their directory changes.
+    for (uint32_t i = 0; i < header()->directory_count; i++) {
+        const DirectoryRecord& directory = directories()[i];
+        if (modification_time(string(directory.path)) != directory.modified) return false;
+    }
+    return header()->directory_count > 0;
+}
+
+const FontIndex::Header* FontIndex::header() const {
+    return static_cast<const Header*>(base);
+}
+
+const FontIndex::DirectoryRecord* FontIndex::directories() const {
+    return reinterpret_cast<const DirectoryRecord*>(header() + 1);
+}
+
+const FontIndex::FaceRecord* FontIndex::faces() const {
+    return reinterpret_cast<const FaceRecord*>(directories() + header()->directory_count);
+}
+
+const char* FontIndex::string(uint32_t offset) const {
+    const char* strings = reinterpret_cast<const char*>(faces() + header()->face_count);
+    return offset < header()->strings_size ? strings + offset : "";
+}
+
+size_t FontIndex::face_count() const {
+    return header()->face_count;
+}
+
+std::shared_ptr<const FontFile> FontIndex::find(const std::string& family,
+                                                const std::string& style) const {
+    const FaceRecord* match = nullptr;
+    for (uint32_t i = 0; i < header()->face_count; i++) {
+        const FaceRecord& face = faces()[i];
+        if (strcasecmp(string(face.family), family.c_str()) != 0) continue;
+
+        const char* face_style = string(face.style);
+        if (!style.empty() ? strcasecmp(face_style, style.c_str()) == 0
+                           : strcasecmp(face_style, "Regular") == 0) {
+            match = &face;
+            break;
+        }
+        if (style.empty() && !match) match = &face;
+    }
+    return match ? FontFile::open(string(match->path), match->face_index) : nullptr;
+}
+
+std::shared_ptr<const FontFile> FontIndex::fallback(char32_t c) const {
+    if (c >= 0x110000) return nullptr;
+    uint32_t page = c / 256;
+    for (uint32_t i = 0; i < header()->face_count; i++) {
+        const FaceRecord& face = faces()[i];
+        if (!(face.coverage[page / 8] & (1 << (page % 8)))) continue;
+
+        std::shared_ptr<const FontFile> font = FontFile::open(string(face.path), face.face_index);
+        if (font && font->glyph_index(c) != 0) return font;
+    }
+    return nullptr;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "glyph.h"
+#include "rasterizer.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct LoadedGlyph {
+    char32_t codepoint;
+    RasterizedGlyph bitmap;
+    std::vector<uint8_t> pixels;
+};
+
+// Loads the primary font and rasterizes printable ASCII on worker threads.
+//
+// Loading starts as soon as the loader is constructed, so it overlaps with creating the window
+// and the GL context; the renderer only waits for it when it uploads the glyphs for the first
+// frame.
+class FontLoader {
+public:
+    FontLoader(std::string family, float pixel_size);
+    ~FontLoader();
+
+    FontLoader(const FontLoader&) = delete;
+    FontLoader& operator=(const FontLoader&) = delete;
+
+    // Blocks until loading finished. Everything below is only valid afterwards.
+    void wait();
+
+    std::unique_ptr<Rasterizer> take_rasterizer() {
+        return std::move(rasterizer);
+    }
+
+    CellMetrics cell_metrics() const {
+        return metrics;
+    }
+
+    // Every printable ASCII character, with empty bitmaps for those without ink.
+    std::vector<LoadedGlyph>& ascii_glyphs() {
+        return glyphs;
+    }
+
+private:
+    void load();
+    void rasterize_ascii(size_t worker, size_t worker_count);
+
+    std::string family;
+    float pixel_size;
+
+    std::unique_ptr<Rasterizer> rasterizer;
+    CellMetrics metrics = {};
+    std::vector<LoadedGlyph> glyphs;
+
+    std::thread loader;
+};
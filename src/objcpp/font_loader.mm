@@ -0,0 +1,86 @@
+#import "font_loader.h"
+#import "font_index.h"
+#import "shared_glyph_cache.h"
+#import "startup_timeline.h"
+#import <algorithm>
+#import <string>
+#import <utility>
+
+namespace {
+
+constexpr char32_t kFirstAscii = U' ';
+constexpr char32_t kLastAscii = U'~';
+
+// Rasterizing all of ASCII takes a few milliseconds; more threads than this cost more to start
+// than they save.
+constexpr size_t kMaxWorkers = 4;
+
+}
+
+FontLoader::FontLoader(std::string family, float pixel_size)
+    : family(std::move(family)), pixel_size(pixel_size) {
+    loader = std::thread([this] { load(); });
+}
+
+FontLoader::~FontLoader() {
+    wait();
+}
+
+void FontLoader::wait() {
+    if (loader.joinable()) loader.join();
+}
+
+void FontLoader::load() {
+    const FontIndex* index = FontIndex::open_default();
+    record_startup_phase("font", "font index");
+
+    std::shared_ptr<const FontFile> font = index ? index->find(family, "") : nullptr;
+    rasterizer = font ? std::make_unique<Rasterizer>(std::move(font), pixel_size)
+                      : std::make_unique<Rasterizer>(family, pixel_size);
+    metrics = rasterizer->cell_metrics();
+    record_startup_phase("font", "font mapped");
+
+    // Every worker fills its own slots, so none of them share anything but the rasterizer.
+    glyphs.resize(kLastAscii - kFirstAscii + 1);
+    size_t worker_count =
+        std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, kMaxWorkers);
+    std::vector<std::thread> workers;
+    for (size_t worker = 1; worker < worker_count; worker++) {
+        workers.emplace_back([this, worker, worker_count] {
+            rasterize_ascii(worker, worker_count);
+        });
+    }
+    rasterize_ascii(0, worker_count);
+    for (std::thread& worker : workers) worker.join();
+    record_startup_phase("font", "ascii joined");
+}
+
+void FontLoader::rasterize_ascii(size_t worker, size_t worker_count) {
+    // The first share is rasterized on the loader thread itself.
+    std::string thread = worker == 0 ? "font" : "font-" + std::to_string(worker);
+    if (worker != 0) record_startup_phase(thread.c_str(), "worker started");
+
+    SharedGlyphCache* shared_cache = SharedGlyphCache::open_default();
+
+    for (size_t i = worker; i < glyphs.size(); i += worker_count) {
+        LoadedGlyph& glyph = glyphs[i];
+        glyph.codepoint = kFirstAscii + char32_t(i);
+
+        // Bitmaps other processes already rasterized are copied out of shared memory.
+        uint32_t glyph_index = rasterizer->glyph_index(glyph.codepoint);
+        GlyphKey key = rasterizer->key(glyph_index);
+        if (shared_cache && shared_cache->lookup(key, &glyph.bitmap)) {
+            glyph.pixels.assign(glyph.bitmap.buffer,
+                                glyph.bitmap.buffer + size_t(glyph.bitmap.width) *
+                                                          glyph.bitmap.height * 3);
+            glyph.bitmap.buffer = glyph.pixels.data();
+        } else {
+            glyph.bitmap = rasterizer->rasterize(glyph_index, &glyph.pixels);
+            if (shared_cache && glyph.bitmap.buffer) shared_cache->insert(key, glyph.bitmap);
+        }
+        // Shared bitmaps are placed relative to the baseline, which depends on the primary font.
+        if (glyph.bitmap.buffer) glyph.bitmap.top = int16_t(glyph.bitmap.top + metrics.baseline);
+    }
+
+    record_startup_phase(thread.c_str(), "ascii share");
+}
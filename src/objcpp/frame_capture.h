@@ -0,0 +1,107 @@
+#pragma once
+
+#include "renderer.h"
+#include <OpenGL/gl3.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reads drawn frames back without stalling the pipeline.
+//
+// Each capture is a `glReadPixels` into one of a small ring of pixel buffer objects, followed by a
+// fence. The buffer is only mapped once its fence has signalled, a few frames later, and the
+// pixels are handed to a worker thread that runs the callback and encodes the frame. When every
+// buffer in the ring is still in flight the capture is dropped rather than waited for, so
+// recording never slows down drawing.
+class FrameCapture {
+public:
+    FrameCapture();
+    ~FrameCapture();
+
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    // Captures the next `frame_count` drawn frames, or every frame until `stop` when it is zero.
+    void start(CaptureFormat format, std::string path_prefix, FrameCallback callback,
+               void* callback_data, uint32_t frame_count);
+
+    // Stops capturing and returns once every frame captured so far has been delivered.
+    void stop();
+
+    bool active() const {
+        return remaining_frames != 0;
+    }
+
+    // Queues a readback of the bound read framebuffer, once the frame has been drawn into it.
+    void capture(uint64_t frame, GLsizei width, GLsizei height);
+
+    // Hands finished readbacks to the worker. Returns true while some are still in flight.
+    bool poll();
+
+    // Forgets readbacks of the lost context; its buffers and fences are gone with it.
+    void context_lost();
+
+    uint64_t captured() const {
+        return captured_count;
+    }
+
+    uint64_t dropped() const {
+        return dropped_count;
+    }
+
+private:
+    static constexpr size_t kSlotCount = 3;
+
+    struct Slot {
+        GLuint pbo = 0;
+        size_t capacity = 0;
+        GLsync fence = nullptr;
+
+        uint64_t frame = 0;
+        GLsizei width = 0;
+        GLsizei height = 0;
+    };
+
+    // Everything the worker needs, so it never reads the capture settings.
+    struct Job {
+        uint64_t frame;
+        uint32_t width;
+        uint32_t height;
+        std::vector<uint8_t> pixels;
+
+        CaptureFormat format;
+        std::string path_prefix;
+        FrameCallback callback;
+        void* callback_data;
+    };
+
+    bool retire(Slot& slot, bool wait);
+    void encode_loop();
+
+    Slot slots[kSlotCount];
+    // Oldest slot, which is also the next one to capture into.
+    size_t next_slot = 0;
+
+    CaptureFormat format = kCaptureNone;
+    std::string path_prefix;
+    FrameCallback callback = nullptr;
+    void* callback_data = nullptr;
+    // Zero when idle; UINT32_MAX captures until stopped.
+    uint32_t remaining_frames = 0;
+
+    uint64_t captured_count = 0;
+    uint64_t dropped_count = 0;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::condition_variable drained;
+    std::deque<Job> jobs;
+    bool encoding = false;
+    bool stopping = false;
+    std::thread worker;
+};
@@ -0,0 +1,220 @@
+#import "frame_capture.h"
+#import <ImageIO/ImageIO.h>
+#import <cstring>
+#import <fstream>
+#import <iostream>
+
+namespace {
+
+// How long `stop` waits for a readback before giving up on it.
+constexpr GLuint64 kStopTimeoutNs = 1000000000;
+
+bool write_png(const std::string& path, uint32_t width, uint32_t height,
+               const std::vector<uint8_t>& pixels) {
+    CFURLRef url = CFURLCreateFromFileSystemRepresentation(
+        nullptr, reinterpret_cast<const UInt8*>(path.c_str()), path.size(), false);
+    if (!url) return false;
+    CGImageDestinationRef destination =
+        CGImageDestinationCreateWithURL(url, CFSTR("public.png"), 1, nullptr);
+    CFRelease(url);
+    if (!destination) return false;
+
+    // The window's alpha channel is meaningless once composited, so it is not written out.
+    CGDataProviderRef provider =
+        CGDataProviderCreateWithData(nullptr, pixels.data(), pixels.size(), nullptr);
+    CGColorSpaceRef color_space = CGColorSpaceCreateDeviceRGB();
+    CGImageRef image = CGImageCreate(width, height, 8, 32, width * 4, color_space,
+                                     kCGImageAlphaNoneSkipLast | kCGBitmapByteOrder32Big,
+                                     provider, nullptr, false, kCGRenderingIntentDefault);
+    CGColorSpaceRelease(color_space);
+    CGDataProviderRelease(provider);
+
+    bool written = false;
+    if (image) {
+        CGImageDestinationAddImage(destination, image, nullptr);
+        written = CGImageDestinationFinalize(destination);
+        CGImageRelease(image);
+    }
+    CFRelease(destination);
+    return written;
+}
+
+bool write_raw(const std::string& path, const std::vector<uint8_t>& pixels) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+    return bool(file);
+}
+
+}
+
+FrameCapture::FrameCapture() {
+    worker = std::thread(&FrameCapture::encode_loop, this);
+}
+
+FrameCapture::~FrameCapture() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_one();
+    worker.join();
+
+    for (Slot& slot : slots) {
+        if (slot.fence) glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.pbo);
+    }
+}
+
+void FrameCapture::start(CaptureFormat format, std::string path_prefix, FrameCallback callback,
+                         void* callback_data, uint32_t frame_count) {
+    this->format = format;
+    this->path_prefix = std::move(path_prefix);
+    this->callback = callback;
+    this->callback_data = callback_data;
+    remaining_frames = frame_count ? frame_count : UINT32_MAX;
+}
+
+void FrameCapture::stop() {
+    remaining_frames = 0;
+
+    // Oldest first, so frames are still delivered in order.
+    for (size_t i = 0; i < kSlotCount; i++) {
+        Slot& slot = slots[(next_slot + i) % kSlotCount];
+        if (slot.fence && !retire(slot, true)) {
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+            dropped_count++;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [this] { return jobs.empty() && !encoding; });
+}
+
+void FrameCapture::capture(uint64_t frame, GLsizei width, GLsizei height) {
+    if (!active()) return;
+
+    Slot& slot = slots[next_slot];
+    if (slot.fence && !retire(slot, false)) {
+        dropped_count++;
+        return;
+    }
+
+    size_t size = size_t(width) * height * 4;
+    if (!slot.pbo) glGenBuffers(1, &slot.pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    if (slot.capacity < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+        slot.capacity = size;
+    }
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frame = frame;
+    slot.width = width;
+    slot.height = height;
+    next_slot = (next_slot + 1) % kSlotCount;
+
+    if (remaining_frames != UINT32_MAX) remaining_frames--;
+}
+
+bool FrameCapture::poll() {
+    bool in_flight = false;
+    for (size_t i = 0; i < kSlotCount; i++) {
+        Slot& slot = slots[(next_slot + i) % kSlotCount];
+        if (!slot.fence) continue;
+
+        // Readbacks complete in order, so a pending one means the younger ones are pending too.
+        if (!retire(slot, false)) {
+            in_flight = true;
+            break;
+        }
+    }
+    return in_flight;
+}
+
+void FrameCapture::context_lost() {
+    for (Slot& slot : slots) {
+        if (slot.fence) dropped_count++;
+        slot = Slot{};
+    }
+}
+
+bool FrameCapture::retire(Slot& slot, bool wait) {
+    GLenum status = glClientWaitSync(slot.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                     wait ? kStopTimeoutNs : 0);
+    if (status == GL_TIMEOUT_EXPIRED) return false;
+    glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+    if (status == GL_WAIT_FAILED) {
+        dropped_count++;
+        return true;
+    }
+
+    Job job{slot.frame, uint32_t(slot.width), uint32_t(slot.height), {}, format, path_prefix,
+            callback, callback_data};
+    size_t stride = size_t(slot.width) * 4;
+    job.pixels.resize(stride * slot.height);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    const uint8_t* mapped = static_cast<const uint8_t*>(
+        glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, job.pixels.size(), GL_MAP_READ_BIT));
+    if (mapped) {
+        // GL returns the bottom row first.
+        for (GLsizei y = 0; y < slot.height; y++) {
+            memcpy(&job.pixels[y * stride], mapped + (slot.height - 1 - y) * stride, stride);
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!mapped) {
+        dropped_count++;
+        return true;
+    }
+
+    captured_count++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    condition.notify_one();
+    return true;
+}
+
+void FrameCapture::encode_loop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            encoding = true;
+        }
+
+        if (job.callback) {
+            job.callback(job.callback_data, job.frame, job.width, job.height, job.pixels.data());
+        }
+
+        std::string path = job.path_prefix + "-" + std::to_string(job.frame);
+        bool written = true;
+        if (job.format == kCapturePng) {
+            written = write_png(path + ".png", job.width, job.height, job.pixels);
+        } else if (job.format == kCaptureRaw) {
+            path += "-" + std::to_string(job.width) + "x" + std::to_string(job.height) + ".rgba";
+            written = write_raw(path, job.pixels);
+        }
+        if (!written) std::cerr << "failed to write captured frame " << job.frame << '\n';
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            encoding = false;
+        }
+        drained.notify_all();
+    }
+}
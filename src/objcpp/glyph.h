@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct GlyphKey {
+    uint64_t font_hash;
+    uint32_t glyph_id;
+    // Font size in 1/64 points.
+    uint32_t size;
+    uint8_t subpixel_bin;
+
+    bool operator==(const GlyphKey& other) const {
+        return font_hash == other.font_hash && glyph_id == other.glyph_id &&
+               size == other.size && subpixel_bin == other.subpixel_bin;
+    }
+};
+
+struct RasterizedGlyph {
+    int16_t left;
+    int16_t top;
+    int16_t width;
+    int16_t height;
+
+    // Tightly packed rows, `width * height * 3` bytes of RGB coverage, or `width * height * 4`
+    // bytes of premultiplied RGBA when `colored`.
+    const uint8_t* buffer;
+    bool colored = false;
+
+    size_t bytes_per_pixel() const {
+        return colored ? 4 : 3;
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "atlas.h"
+#include "epoch_reclaimer.h"
+#include "glyph.h"
+#include "glyph_uploader.h"
+#include <OpenGL/gl3.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Set in the key of glyphs drawn from the color emoji font; the rest of a key is the code point.
+constexpr uint64_t kColorGlyphKey = uint64_t(1) << 32;
+
+// An immutable version of the glyph cache's entries: open addressing with linear probing, at most
+// half full.
+class GlyphSnapshot {
+public:
+    explicit GlyphSnapshot(size_t capacity);
+
+    const Glyph* find(uint64_t key) const;
+
+    size_t size() const {
+        return count;
+    }
+
+private:
+    friend class GlyphCache;
+
+    struct Slot {
+        uint64_t key;
+        Glyph glyph;
+    };
+
+    void add(uint64_t key, const Glyph& glyph);
+
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t count = 0;
+};
+
+// Atlas entries of every rasterized glyph, and the pages holding them.
+//
+// Lookups read an immutable snapshot through a single atomic load, so the render thread and any
+// thread helping it build a frame never take a lock or write a shared cache line for a hit; they
+// may hold a snapshot until the frame they read it in ends. Inserts collect in a batch only the
+// inserting thread sees, until `publish` merges them into a new snapshot and swaps it in. Replaced
+// snapshots are freed through the reclaimer once the frame that could still be reading them has
+// completed.
+//
+// Pages are capped. Once the cap is reached, publishing keeps one page in reserve by evicting the
+// least recently drawn one whole: the new snapshot leaves its entries out, and the page is retired
+// to the reclaimer, which hands it back for reuse only after every frame that may have read it has
+// completed on the GPU. Pages read by the frame being built are never evicted, so instances built
+// earlier in the frame stay valid.
+class GlyphCache {
+public:
+    GlyphCache(EpochReclaimer& reclaimer, size_t max_pages);
+    ~GlyphCache();
+
+    GlyphCache(const GlyphCache&) = delete;
+    GlyphCache& operator=(const GlyphCache&) = delete;
+
+    // Looks `key` up in the published snapshot and, on the inserting thread, in the unpublished
+    // batch. Marks the glyph's page as read by the current frame.
+    bool find(uint64_t key, Glyph* out);
+
+    // Looks `key` up in the published snapshot only. Safe on any thread during a frame.
+    bool find_published(uint64_t key, Glyph* out);
+
+    // Marks `page` as read by the current frame, for instances reused without a lookup.
+    void mark_page_used(uint16_t page);
+
+    // Places `glyph` in the atlas, uploading it right away or through `uploader` when it is not
+    // null, and adds it to the batch under `key`. Only one thread inserts.
+    Glyph insert(uint64_t key, const RasterizedGlyph& glyph, GlyphUploader* uploader);
+    // Places a glyph the caller keeps for the renderer's lifetime; its page is never evicted.
+    Glyph insert_pinned(const RasterizedGlyph& glyph, GlyphUploader* uploader);
+
+    // Makes the batch visible to every reader with one new snapshot, evicting a page first when
+    // the cap leaves none in reserve. Called by the inserting thread once it built a frame's
+    // instances.
+    void publish();
+
+    GLuint texture(uint16_t page) const {
+        return pages[page].atlas->texture();
+    }
+
+    uint16_t page_count() const {
+        return uint16_t(pages.size());
+    }
+
+    // Recreates every page in the now current context.
+    void restore();
+
+    // Bytes of every page's shadow, compressed and as the bitmaps it restores.
+    size_t shadow_size() const;
+    size_t raw_size() const;
+
+    // Pages evicted so far. Instances built before an eviction may point into the evicted page.
+    uint64_t evictions() const {
+        return eviction_count;
+    }
+
+    uint64_t snapshots_published() const {
+        return publish_count;
+    }
+
+private:
+    struct Page {
+        std::unique_ptr<Atlas> atlas;
+        bool pinned = false;
+        bool retired = false;
+        // Epoch the page was retired in, while it is.
+        uint64_t retired_at = 0;
+    };
+
+    Glyph place(const RasterizedGlyph& glyph, GlyphUploader* uploader);
+    int open_page(GlyphUploader* uploader);
+    int evict_least_recent();
+    void mark_used(const Glyph& glyph);
+    // Publishes the batch, leaving out every glyph on `evicted_page` unless it is -1.
+    void publish_snapshot(int evicted_page);
+
+    EpochReclaimer& reclaimer;
+    size_t max_pages;
+
+    std::atomic<const GlyphSnapshot*> snapshot;
+    std::unordered_map<uint64_t, Glyph> batch;
+    uint64_t publish_count = 0;
+
+    std::vector<Page> pages;
+    // Epoch of the last frame that read each page. Fixed in size, since readers on other threads
+    // stamp it while pages are added.
+    std::unique_ptr<std::atomic<uint64_t>[]> page_used;
+    // Page new glyphs go to.
+    uint16_t filling = 0;
+    // Pages the GPU is done with since they were evicted.
+    std::vector<uint16_t> free_pages;
+
+    uint64_t eviction_count = 0;
+};
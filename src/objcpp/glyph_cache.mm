@@ -0,0 +1,219 @@
+#import "glyph_cache.h"
+#import "hash.h"
+#import <algorithm>
+
+namespace {
+
+constexpr uint64_t kEmptyKey = ~uint64_t(0);
+
+// Page indices are stamped into a fixed array, so pages stop being added here even when every one
+// of them is read by the frame being built.
+constexpr size_t kPageLimit = 256;
+
+}
+
+GlyphSnapshot::GlyphSnapshot(size_t capacity) {
+    size_t slot_count = 16;
+    while (slot_count < capacity * 2) slot_count *= 2;
+    slots.assign(slot_count, Slot{kEmptyKey, {}});
+    mask = slot_count - 1;
+}
+
+const Glyph* GlyphSnapshot::find(uint64_t key) const {
+    for (size_t i = hash_mix(key) & mask;; i = (i + 1) & mask) {
+        if (slots[i].key == key) return &slots[i].glyph;
+        if (slots[i].key == kEmptyKey) return nullptr;
+    }
+}
+
+void GlyphSnapshot::add(uint64_t key, const Glyph& glyph) {
+    size_t i = hash_mix(key) & mask;
+    while (slots[i].key != kEmptyKey && slots[i].key != key) i = (i + 1) & mask;
+    if (slots[i].key == kEmptyKey) count++;
+    slots[i] = Slot{key, glyph};
+}
+
+GlyphCache::GlyphCache(EpochReclaimer& reclaimer, size_t max_pages)
+    : reclaimer(reclaimer),
+      max_pages(max_pages),
+      snapshot(new GlyphSnapshot(0)),
+      page_used(new std::atomic<uint64_t>[kPageLimit]) {
+    for (size_t i = 0; i < kPageLimit; i++) page_used[i].store(0, std::memory_order_relaxed);
+}
+
+GlyphCache::~GlyphCache() {
+    delete snapshot.load(std::memory_order_acquire);
+}
+
+bool GlyphCache::find(uint64_t key, Glyph* out) {
+    if (find_published(key, out)) return true;
+
+    auto it = batch.find(key);
+    if (it == batch.end()) return false;
+    *out = it->second;
+    mark_used(*out);
+    return true;
+}
+
+bool GlyphCache::find_published(uint64_t key, Glyph* out) {
+    const Glyph* glyph = snapshot.load(std::memory_order_acquire)->find(key);
+    if (!glyph) return false;
+    *out = *glyph;
+    mark_used(*out);
+    return true;
+}
+
+void GlyphCache::mark_used(const Glyph& glyph) {
+    if (glyph.width != 0) mark_page_used(glyph.page);
+}
+
+// Stores only the first time a page is read in a frame, so hits rarely write at all.
+void GlyphCache::mark_page_used(uint16_t page) {
+    std::atomic<uint64_t>& used = page_used[page];
+    uint64_t epoch = reclaimer.epoch();
+    if (used.load(std::memory_order_relaxed) != epoch) used.store(epoch, std::memory_order_relaxed);
+}
+
+Glyph GlyphCache::insert(uint64_t key, const RasterizedGlyph& glyph, GlyphUploader* uploader) {
+    Glyph out = place(glyph, uploader);
+    batch[key] = out;
+    return out;
+}
+
+Glyph GlyphCache::insert_pinned(const RasterizedGlyph& glyph, GlyphUploader* uploader) {
+    Glyph out = place(glyph, uploader);
+    if (out.width != 0) pages[out.page].pinned = true;
+    return out;
+}
+
+Glyph GlyphCache::place(const RasterizedGlyph& glyph, GlyphUploader* uploader) {
+    // Glyphs without ink, such as spaces, take no atlas space and draw nothing.
+    Glyph out = {};
+    if (glyph.width == 0 || glyph.height == 0) return out;
+
+    AtlasRegion region;
+    if (pages.empty() || !pages[filling].atlas->reserve(glyph, &out, &region)) {
+        int page = open_page(uploader);
+        if (page < 0) return Glyph{};
+        filling = uint16_t(page);
+        if (!pages[filling].atlas->reserve(glyph, &out, &region)) return Glyph{};
+    }
+    out.page = filling;
+    mark_used(out);
+
+    if (uploader) {
+        out.upload = uploader->queue(region, glyph);
+    } else {
+        Atlas::upload(region, glyph);
+    }
+    return out;
+}
+
+int GlyphCache::open_page(GlyphUploader* uploader) {
+    reclaimer.collect();
+
+    // The reserve page was retired by an earlier frame, which has almost always completed.
+    if (free_pages.empty()) {
+        uint64_t oldest = kEmptyKey;
+        for (const Page& page : pages) {
+            if (page.retired) oldest = std::min(oldest, page.retired_at);
+        }
+        if (oldest < reclaimer.epoch()) reclaimer.wait(oldest);
+    }
+
+    if (!free_pages.empty()) {
+        uint16_t page = free_pages.back();
+        free_pages.pop_back();
+        return page;
+    }
+
+    // Past the cap only when a frame fills more than the page in reserve.
+    if (pages.size() >= kPageLimit) return -1;
+    pages.emplace_back();
+    pages.back().atlas = std::make_unique<Atlas>();
+    // The upload context only sees the new page once its creation is flushed.
+    if (uploader) glFlush();
+    return int(pages.size() - 1);
+}
+
+// Returns the evicted page, or -1 when every page is pinned, already retired or read by the
+// frame being built.
+int GlyphCache::evict_least_recent() {
+    uint64_t epoch = reclaimer.epoch();
+    int victim = -1;
+    uint64_t victim_used = 0;
+    for (size_t i = 0; i < pages.size(); i++) {
+        const Page& page = pages[i];
+        uint64_t used = page_used[i].load(std::memory_order_relaxed);
+        if (page.pinned || page.retired || i == filling || used >= epoch) continue;
+        if (victim < 0 || used < victim_used) {
+            victim = int(i);
+            victim_used = used;
+        }
+    }
+    if (victim < 0) return -1;
+
+    // Readers may have found the page's glyphs in the snapshot being replaced, so it stays intact
+    // until the current frame completes.
+    Page& page = pages[victim];
+    page.retired = true;
+    page.retired_at = epoch;
+    eviction_count++;
+
+    reclaimer.retire(epoch, [this, victim] {
+        pages[victim].atlas->clear();
+        pages[victim].retired = false;
+        free_pages.push_back(uint16_t(victim));
+    });
+    return victim;
+}
+
+void GlyphCache::publish() {
+    bool in_reserve = !free_pages.empty() ||
+                      std::any_of(pages.begin(), pages.end(),
+                                  [](const Page& page) { return page.retired; });
+    if (!in_reserve && pages.size() >= max_pages) {
+        int victim = evict_least_recent();
+        if (victim >= 0) {
+            publish_snapshot(victim);
+            return;
+        }
+    }
+    if (!batch.empty()) publish_snapshot(-1);
+}
+
+void GlyphCache::publish_snapshot(int evicted_page) {
+    auto evicted = [evicted_page](const Glyph& glyph) {
+        return glyph.width != 0 && glyph.page == evicted_page;
+    };
+
+    const GlyphSnapshot* current = snapshot.load(std::memory_order_relaxed);
+    auto* next = new GlyphSnapshot(current->size() + batch.size());
+    for (const GlyphSnapshot::Slot& slot : current->slots) {
+        if (slot.key != kEmptyKey && !evicted(slot.glyph)) next->add(slot.key, slot.glyph);
+    }
+    for (const auto& [key, glyph] : batch) {
+        if (!evicted(glyph)) next->add(key, glyph);
+    }
+    batch.clear();
+
+    snapshot.store(next, std::memory_order_release);
+    publish_count++;
+    reclaimer.retire(reclaimer.epoch(), [current] { delete current; });
+}
+
+void GlyphCache::restore() {
+    for (Page& page : pages) page.atlas->restore();
+}
+
+size_t GlyphCache::shadow_size() const {
+    size_t bytes = 0;
+    for (const Page& page : pages) bytes += page.atlas->shadow_size();
+    return bytes;
+}
+
+size_t GlyphCache::raw_size() const {
+    size_t bytes = 0;
+    for (const Page& page : pages) bytes += page.atlas->raw_size();
+    return bytes;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "atlas.h"
+#include "glyph.h"
+#include <OpenGL/OpenGL.h>
+#include <OpenGL/gl3.h>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Uploads glyph bitmaps into atlas pages from a worker thread with its own context, which shares
+// objects with the renderer's.
+//
+// Every queued upload gets a ticket, counting up. After each batch the worker inserts a fence and
+// flushes, so the render thread never issues the uploads itself; it only makes the GPU wait for
+// the fence covering the newest ticket among the glyphs a frame draws. Bursts of new glyphs then
+// delay the frames that show them, not every frame submitted meanwhile.
+class GlyphUploader {
+public:
+    // Returns nullptr unless GLYPH_ATLAS_UPLOAD_THREAD=1 and a context sharing with `share` could
+    // be created. Tickets up to `first_ticket` count as finished, so glyphs queued on an uploader
+    // this one replaces never wait.
+    static std::unique_ptr<GlyphUploader> create(CGLContextObj share, uint64_t first_ticket = 0);
+    ~GlyphUploader();
+
+    GlyphUploader(const GlyphUploader&) = delete;
+    GlyphUploader& operator=(const GlyphUploader&) = delete;
+
+    // Copies `glyph` and queues it for upload into `region`, whose texture the worker's context
+    // must already see: textures created on the render thread only are after it flushed. Returns
+    // the upload's ticket.
+    uint64_t queue(const AtlasRegion& region, const RasterizedGlyph& glyph);
+
+    // Makes commands issued by the current context from now on wait on the GPU for upload
+    // `ticket`. Blocks only while the worker has not issued it yet.
+    void wait(uint64_t ticket);
+
+    // The newest ticket handed out.
+    uint64_t last_ticket() const {
+        return queued_ticket;
+    }
+
+    uint64_t uploads() const {
+        return queued_ticket - first_ticket;
+    }
+
+    // Times `wait` had to block for the worker, and for how long in total.
+    uint64_t stalls() const {
+        return stall_count;
+    }
+
+    uint64_t stall_us() const {
+        return stall_time_us;
+    }
+
+private:
+    struct UploadJob {
+        AtlasRegion region;
+        RasterizedGlyph glyph;
+        std::vector<uint8_t> pixels;
+    };
+
+    GlyphUploader(CGLContextObj context, uint64_t first_ticket);
+    void upload_loop();
+
+    CGLContextObj context;
+    uint64_t first_ticket;
+
+    // Only touched by the render thread.
+    uint64_t queued_ticket;
+    uint64_t waited_ticket;
+    uint64_t stall_count = 0;
+    uint64_t stall_time_us = 0;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::condition_variable fenced;
+    std::deque<UploadJob> jobs;
+    // Fences of the batches not waited for yet, with the newest ticket each one covers.
+    std::deque<std::pair<uint64_t, GLsync>> fences;
+    uint64_t fenced_ticket;
+    bool stopping = false;
+    std::thread worker;
+};
@@ -0,0 +1,121 @@
+#import "glyph_uploader.h"
+#import <chrono>
+#import <cstdlib>
+#import <cstring>
+
+std::unique_ptr<GlyphUploader> GlyphUploader::create(CGLContextObj share, uint64_t first_ticket) {
+    const char* enabled = getenv("GLYPH_ATLAS_UPLOAD_THREAD");
+    if (!enabled || strcmp(enabled, "1") != 0 || !share) return nullptr;
+
+    CGLContextObj context = nullptr;
+    if (CGLCreateContext(CGLGetPixelFormat(share), share, &context) != kCGLNoError) {
+        return nullptr;
+    }
+    return std::unique_ptr<GlyphUploader>(new GlyphUploader(context, first_ticket));
+}
+
+GlyphUploader::GlyphUploader(CGLContextObj context, uint64_t first_ticket)
+    : context(context),
+      first_ticket(first_ticket),
+      queued_ticket(first_ticket),
+      waited_ticket(first_ticket),
+      fenced_ticket(first_ticket) {
+    worker = std::thread(&GlyphUploader::upload_loop, this);
+}
+
+GlyphUploader::~GlyphUploader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_one();
+    worker.join();
+
+    // Fences nobody waited for belong to the worker's context, which goes away with them.
+    CGLDestroyContext(context);
+}
+
+uint64_t GlyphUploader::queue(const AtlasRegion& region, const RasterizedGlyph& glyph) {
+    UploadJob job{region, glyph, {}};
+    size_t bytes = size_t(glyph.width) * glyph.height * glyph.bytes_per_pixel();
+    job.pixels.assign(glyph.buffer, glyph.buffer + bytes);
+    job.glyph.buffer = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    condition.notify_one();
+    return ++queued_ticket;
+}
+
+void GlyphUploader::wait(uint64_t ticket) {
+    if (ticket <= waited_ticket) return;
+
+    GLsync fence = nullptr;
+    std::vector<GLsync> covered;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (fenced_ticket < ticket) {
+            auto start = std::chrono::steady_clock::now();
+            fenced.wait(lock, [this, ticket] { return fenced_ticket >= ticket; });
+            stall_count++;
+            stall_time_us += uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                          std::chrono::steady_clock::now() - start)
+                                          .count());
+        }
+
+        // Batches complete in order, so waiting for the first fence covering `ticket` also waits
+        // for every older one.
+        while (!fences.empty() && fences.front().first < ticket) {
+            covered.push_back(fences.front().second);
+            fences.pop_front();
+        }
+        waited_ticket = fences.front().first;
+        fence = fences.front().second;
+        fences.pop_front();
+    }
+
+    glWaitSync(fence, 0, GL_TIMEOUT_IGNORED);
+    glDeleteSync(fence);
+    for (GLsync older : covered) glDeleteSync(older);
+}
+
+void GlyphUploader::upload_loop() {
+    CGLSetCurrentContext(context);
+
+    std::deque<UploadJob> batch;
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ticket = fenced_ticket;
+    }
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) break;
+            batch.swap(jobs);
+        }
+
+        for (UploadJob& job : batch) {
+            job.glyph.buffer = job.pixels.data();
+            Atlas::upload(job.region, job.glyph);
+        }
+        ticket += batch.size();
+        batch.clear();
+
+        // The flush puts the fence where the render context's wait can see it.
+        GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fences.emplace_back(ticket, fence);
+            fenced_ticket = ticket;
+        }
+        fenced.notify_one();
+    }
+
+    CGLSetCurrentContext(nullptr);
+}
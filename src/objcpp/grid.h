@@ -0,0 +1,72 @@
+#pragma once
+
+#include "unicode.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct Cell {
+    // Unicode scalar value; blank cells hold a space.
+    char32_t codepoint = U' ';
+};
+
+// Columns of a row covered by a detected hyperlink, `end` exclusive.
+struct LinkSpan {
+    uint16_t start;
+    uint16_t end;
+
+    bool operator==(const LinkSpan& other) const {
+        return start == other.start && end == other.end;
+    }
+};
+
+struct Row {
+    std::vector<Cell> cells;
+
+    // The line continues on the next row because it reached the right edge.
+    bool wrapped = false;
+
+    // Hyperlinks in the row, ordered by column.
+    std::vector<LinkSpan> links;
+    // Identifies the row's latest link detection request, so stale results can be dropped. Zero
+    // when none is pending.
+    uint32_t link_version = 0;
+};
+
+struct Grid {
+    uint16_t columns = 0;
+    std::vector<Row> rows;
+
+    // Where the next character is written.
+    uint16_t cursor_col = 0;
+    uint16_t cursor_row = 0;
+
+    // Rows scrolled out at the top so far, so whatever is anchored to rows can follow them.
+    uint64_t scrolled_rows = 0;
+
+    // Keeps the contents that still fit. Links are detected again once the rows are damaged.
+    void resize(uint16_t new_columns, uint16_t new_lines) {
+        columns = new_columns;
+        rows.resize(new_lines);
+        for (Row& row : rows) {
+            row.cells.resize(columns);
+            row.links.clear();
+            row.link_version = 0;
+        }
+        cursor_col = std::min<uint16_t>(cursor_col, columns);
+        cursor_row = std::min<uint16_t>(cursor_row, std::max<uint16_t>(new_lines, 1) - 1);
+    }
+
+    // Writes decoded text at the cursor, wrapping at the right edge and scrolling at the bottom.
+    // Rows whose cells changed are added to `damage`; entries already in it follow their rows
+    // when the grid scrolls. Code points that continue a grapheme cluster stay with the cell of
+    // the cluster's first one and, like other characters without width, are dropped, since a cell
+    // holds one code point. Clusters may continue across writes.
+    void write(const char32_t* text, size_t size, std::vector<uint16_t>* damage);
+
+private:
+    void line_feed(std::vector<uint16_t>* damage);
+    std::vector<uint8_t> widths;
+    GraphemeBreaker breaker;
+};
@@ -0,0 +1,67 @@
+#import "grid.h"
+#import "unicode.h"
+
+void Grid::write(const char32_t* text, size_t size, std::vector<uint16_t>* damage) {
+    if (rows.empty() || columns == 0) return;
+
+    widths.resize(size);
+    char_widths(text, size, widths.data());
+
+    for (size_t i = 0; i < size; i++) {
+        char32_t c = text[i];
+        // Consulted for controls as well, so nothing attaches across them. A LF right after a CR
+        // continues its cluster but still moves the cursor.
+        bool continues_cluster = !breaker.starts_cluster(c);
+        switch (c) {
+        case U'\n':
+            line_feed(damage);
+            continue;
+        case U'\r':
+            cursor_col = 0;
+            continue;
+        case U'\b':
+            if (cursor_col > 0) cursor_col--;
+            continue;
+        case U'\t':
+            cursor_col = std::min<uint16_t>((cursor_col / 8 + 1) * 8, columns - 1);
+            continue;
+        }
+
+        uint16_t width = widths[i];
+        if (continues_cluster || width == 0 || width > columns) continue;
+
+        if (cursor_col + width > columns) {
+            rows[cursor_row].wrapped = true;
+            cursor_col = 0;
+            line_feed(damage);
+        }
+
+        Row& row = rows[cursor_row];
+        row.cells[cursor_col].codepoint = c;
+        // The second cell of a wide character is left empty.
+        if (width == 2) row.cells[cursor_col + 1].codepoint = 0;
+        cursor_col += width;
+
+        if (damage->empty() || damage->back() != cursor_row) damage->push_back(cursor_row);
+    }
+}
+
+void Grid::line_feed(std::vector<uint16_t>* damage) {
+    if (size_t(cursor_row) + 1 < rows.size()) {
+        cursor_row++;
+        return;
+    }
+
+    // The top row scrolls out and is reused as the new bottom row.
+    std::rotate(rows.begin(), rows.begin() + 1, rows.end());
+    scrolled_rows++;
+    Row& bottom = rows.back();
+    std::fill(bottom.cells.begin(), bottom.cells.end(), Cell{});
+    bottom.wrapped = false;
+    bottom.links.clear();
+    bottom.link_version = 0;
+
+    damage->erase(std::remove(damage->begin(), damage->end(), 0), damage->end());
+    for (uint16_t& row : *damage) row--;
+    damage->push_back(cursor_row);
+}
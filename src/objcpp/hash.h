@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Non-cryptographic hashing for change detection of frame and glyph data.
+
+inline uint64_t hash_mix(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+}
+
+inline uint64_t hash_combine(uint64_t seed, uint64_t value) {
+    return hash_mix(seed ^ (value + 0x9e3779b97f4a7c15));
+}
+
+inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    uint64_t h = hash_combine(seed, size);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = hash_combine(h, word);
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, size - i);
+        h = hash_combine(h, word);
+    }
+    return h;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "shader.h"
+#include <OpenGL/gl3.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct ImagePlacement {
+    uint32_t image_id;
+
+    // Top left cell and the number of cells the image is stretched over. A span of zero keeps the
+    // image's pixel size in that direction.
+    uint16_t col;
+    // Negative once the top of the image scrolled out of the grid.
+    int32_t row;
+    uint16_t columns;
+    uint16_t rows;
+};
+
+// Inline images, kept apart from the glyph atlas.
+//
+// Encoded images are decoded on a worker thread and uploaded as 256x256 tiles into the layers of a
+// single array texture, whose layer count is the cache's memory budget. Uploads are capped per
+// frame so large images never stall a frame, and least recently drawn images are evicted when
+// the layers run out. Evicted images keep their encoded data and are decoded again on demand.
+class ImageCache {
+public:
+    // `on_decoded` is invoked on the worker thread whenever an image is ready for upload.
+    explicit ImageCache(std::function<void()> on_decoded);
+    ~ImageCache();
+
+    ImageCache(const ImageCache&) = delete;
+    ImageCache& operator=(const ImageCache&) = delete;
+
+    // Queues an image in any format ImageIO understands, replacing a previous image with `id`.
+    void submit(uint32_t id, std::vector<uint8_t> data);
+
+    // Uploads decoded tiles within the per-frame budget. Returns true when an image became
+    // drawable, in which case everything showing images has to be drawn again.
+    bool upload();
+
+    // Marks the images in `placements` as on screen, whether or not their pane is drawn again, so
+    // they are not evicted for others. Called before `upload`.
+    void mark_used(const std::vector<ImagePlacement>& placements);
+
+    // Grid rows `placement` covers, counting one for an image whose size is not known yet.
+    uint32_t rows_covered(const ImagePlacement& placement, GLfloat cell_height) const;
+
+    // Draws every resident image in `placements` with one instanced draw call.
+    void draw(const std::vector<ImagePlacement>& placements, const GLfloat projection[4],
+              GLfloat cell_width, GLfloat cell_height);
+
+    // Waits for the image program, which starts compiling on construction.
+    void link();
+
+    // Issues a single image draw into the currently bound framebuffer, so the driver finishes
+    // compiling the program before the first real frame.
+    void warm_up();
+
+    // Drops every tile and recreates the GL objects in the now current context; `link` has to be
+    // called again afterwards. Images are decoded
+    // and uploaded again once they are drawn.
+    void context_lost();
+
+    // Changes whenever the set of drawable images changes.
+    uint64_t generation() const {
+        return resident_generation;
+    }
+
+    uint64_t tiles_uploaded() const {
+        return uploaded_tile_count;
+    }
+
+    uint64_t evictions() const {
+        return eviction_count;
+    }
+
+private:
+    enum class State {
+        kDecoding,
+        kUploading,
+        kResident,
+        kEvicted,
+        kFailed,
+    };
+
+    struct Image {
+        State state = State::kDecoding;
+        // Bumped on every submit so results of stale decodes can be dropped.
+        uint32_t version = 0;
+
+        std::vector<uint8_t> encoded;
+        std::vector<uint8_t> pixels;
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        // Array texture layer of every tile, in row-major tile order.
+        std::vector<GLint> layers;
+        size_t tiles_uploaded = 0;
+
+        uint64_t last_used = 0;
+    };
+
+    struct DecodeJob {
+        uint32_t id;
+        uint32_t version;
+        std::vector<uint8_t> data;
+    };
+
+    struct DecodeResult {
+        uint32_t id;
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        std::vector<uint8_t> pixels;
+    };
+
+    void setup();
+    void decode_loop();
+    void queue_decode(uint32_t id, Image& image);
+    bool reserve_layers(uint32_t id, Image& image);
+    void release_layers(Image& image);
+
+    std::unordered_map<uint32_t, Image> images;
+    std::deque<uint32_t> upload_queue;
+    std::vector<GLint> free_layers;
+
+    GLuint texture = 0;
+    PendingProgram pending_program;
+    GLuint program = 0;
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    GLint u_projection = -1;
+
+    uint64_t frame = 0;
+    uint64_t resident_generation = 0;
+    uint64_t uploaded_tile_count = 0;
+    uint64_t eviction_count = 0;
+
+    std::function<void()> on_decoded;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<DecodeJob> jobs;
+    std::vector<DecodeResult> results;
+    bool stopping = false;
+    std::thread worker;
+};
@@ -0,0 +1,416 @@
+#import "image_cache.h"
+#import "shader.h"
+#import <ImageIO/ImageIO.h>
+#import <algorithm>
+#import <cmath>
+#import <iostream>
+
+namespace {
+
+constexpr GLsizei kTileSize = 256;
+
+// 128 layers of 256x256 RGBA tiles, 32 MiB of texture memory.
+constexpr GLsizei kMaxLayers = 128;
+
+// Tiles uploaded per frame, 4 MiB of pixel data.
+constexpr size_t kTilesPerFrame = 16;
+
+constexpr size_t kMaxInstances = kMaxLayers;
+
+struct ImageInstance {
+    // Destination rectangle in pixels.
+    GLfloat x;
+    GLfloat y;
+    GLfloat width;
+    GLfloat height;
+
+    // Size of the tile within its layer, and the layer itself.
+    GLfloat uv_width;
+    GLfloat uv_height;
+    GLfloat layer;
+};
+
+// Decodes `data` into premultiplied RGBA rows, top row first.
+bool decode_image(const std::vector<uint8_t>& data, uint32_t* width, uint32_t* height,
+                  std::vector<uint8_t>* pixels) {
+    CFDataRef cf_data = CFDataCreate(nullptr, data.data(), data.size());
+    CGImageSourceRef source = CGImageSourceCreateWithData(cf_data, nullptr);
+    CFRelease(cf_data);
+    if (!source) return false;
+
+    CGImageRef image = CGImageSourceCreateImageAtIndex(source, 0, nullptr);
+    CFRelease(source);
+    if (!image) return false;
+
+    *width = CGImageGetWidth(image);
+    *height = CGImageGetHeight(image);
+    pixels->assign(size_t(*width) * *height * 4, 0);
+
+    CGColorSpaceRef color_space = CGColorSpaceCreateDeviceRGB();
+    CGContextRef context = CGBitmapContextCreate(
+        pixels->data(), *width, *height, 8, *width * 4, color_space,
+        kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big);
+    CGColorSpaceRelease(color_space);
+    if (context) {
+        CGContextDrawImage(context, CGRectMake(0, 0, *width, *height), image);
+        CGContextRelease(context);
+    }
+    CGImageRelease(image);
+    return context != nullptr;
+}
+
+}
+
+ImageCache::ImageCache(std::function<void()> on_decoded) : on_decoded(std::move(on_decoded)) {
+    setup();
+
+    for (GLint layer = kMaxLayers - 1; layer >= 0; layer--) free_layers.push_back(layer);
+
+    worker = std::thread(&ImageCache::decode_loop, this);
+}
+
+void ImageCache::setup() {
+    const GLchar* vertSource = R"(
+    #version 330 core
+
+// Destination rectangle.
+layout(location = 0) in vec4 rect;
+
+// Tile size within its layer, and the layer.
+layout(location = 1) in vec3 uv;
+
+out vec3 TexCoords;
+
+uniform vec4 projection;
+
+void main() {
+    vec2 position = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+
+    TexCoords = vec3(position * uv.xy, uv.z);
+    gl_Position = vec4(projection.xy + projection.zw * (rect.xy + rect.zw * position), 0.0, 1.0);
+}
+)";
+    const GLchar* fragSource = R"(
+    #version 330 core
+
+in vec3 TexCoords;
+
+out vec4 color;
+
+uniform sampler2DArray images;
+
+void main() {
+    color = texture(images, TexCoords);
+}
+)";
+    pending_program = begin_program("image", vertSource, fragSource);
+
+    glGenVertexArrays(1, &vao);
+    glGenBuffers(1, &vbo);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, kMaxInstances * sizeof(ImageInstance), nullptr, GL_STREAM_DRAW);
+
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(ImageInstance), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribDivisor(0, 1);
+
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(ImageInstance), (void*)16);
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(1, 1);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void ImageCache::link() {
+    program = finish_program(pending_program);
+    u_projection = glGetUniformLocation(program, "projection");
+}
+
+ImageCache::~ImageCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_one();
+    worker.join();
+
+    glDeleteTextures(1, &texture);
+    glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteProgram(program);
+}
+
+void ImageCache::warm_up() {
+    ImageInstance instance{0.0, 0.0, 1.0, 1.0, 1.0, 1.0, 0.0};
+    GLfloat projection[4] = {-1.0, 1.0, 2.0, -2.0};
+
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(program);
+    glUniform4fv(u_projection, 1, projection);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(instance), &instance);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, 1);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glBlendFunc(GL_SRC1_COLOR, GL_ONE_MINUS_SRC1_COLOR);
+}
+
+void ImageCache::context_lost() {
+    for (auto& [id, image] : images) {
+        release_layers(image);
+        if (image.state == State::kResident) image.state = State::kEvicted;
+    }
+
+    texture = 0;
+    resident_generation++;
+    setup();
+}
+
+void ImageCache::submit(uint32_t id, std::vector<uint8_t> data) {
+    Image& image = images[id];
+    if (image.state == State::kResident) resident_generation++;
+    release_layers(image);
+    upload_queue.erase(std::remove(upload_queue.begin(), upload_queue.end(), id),
+                       upload_queue.end());
+
+    image.encoded = std::move(data);
+    image.pixels.clear();
+    image.version++;
+    queue_decode(id, image);
+}
+
+void ImageCache::queue_decode(uint32_t id, Image& image) {
+    image.state = State::kDecoding;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(DecodeJob{id, image.version, image.encoded});
+    }
+    condition.notify_one();
+}
+
+void ImageCache::decode_loop() {
+    while (true) {
+        DecodeJob job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        DecodeResult result{job.id, job.version, 0, 0, {}};
+        if (!decode_image(job.data, &result.width, &result.height, &result.pixels)) {
+            result.pixels.clear();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            results.push_back(std::move(result));
+        }
+        if (on_decoded) on_decoded();
+    }
+}
+
+bool ImageCache::reserve_layers(uint32_t id, Image& image) {
+    size_t tiles_x = (image.width + kTileSize - 1) / kTileSize;
+    size_t tiles_y = (image.height + kTileSize - 1) / kTileSize;
+    size_t needed = tiles_x * tiles_y;
+
+    if (needed > size_t(kMaxLayers)) {
+        std::cerr << "image " << id << " (" << image.width << "x" << image.height
+                  << ") exceeds the image texture budget\n";
+        image.state = State::kFailed;
+        image.pixels.clear();
+        image.pixels.shrink_to_fit();
+        return false;
+    }
+
+    // Evict the least recently drawn resident images until the tiles fit. Images on screen, drawn
+    // by the last frame or made resident during this one, are kept, so visible images that need
+    // more layers than there are don't keep evicting each other; the upload waits instead.
+    while (free_layers.size() < needed) {
+        Image* victim = nullptr;
+        for (auto& [other_id, other] : images) {
+            if (other.state != State::kResident || other.last_used + 1 >= frame) continue;
+            if (!victim || other.last_used < victim->last_used) victim = &other;
+        }
+        if (!victim) return false;
+
+        release_layers(*victim);
+        victim->state = State::kEvicted;
+        eviction_count++;
+        resident_generation++;
+    }
+
+    image.layers.assign(free_layers.end() - needed, free_layers.end());
+    free_layers.resize(free_layers.size() - needed);
+    image.tiles_uploaded = 0;
+    return true;
+}
+
+void ImageCache::release_layers(Image& image) {
+    free_layers.insert(free_layers.end(), image.layers.begin(), image.layers.end());
+    image.layers.clear();
+    image.tiles_uploaded = 0;
+}
+
+bool ImageCache::upload() {
+    frame++;
+    uint64_t generation = resident_generation;
+
+    std::vector<DecodeResult> decoded;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        decoded.swap(results);
+    }
+    for (DecodeResult& result : decoded) {
+        auto it = images.find(result.id);
+        if (it == images.end() || it->second.version != result.version) continue;
+
+        Image& image = it->second;
+        if (result.pixels.empty()) {
+            image.state = State::kFailed;
+            continue;
+        }
+
+        image.width = result.width;
+        image.height = result.height;
+        image.pixels = std::move(result.pixels);
+        image.state = State::kUploading;
+        upload_queue.push_back(result.id);
+    }
+
+    if (upload_queue.empty()) return generation != resident_generation;
+
+    if (!texture) {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, kTileSize, kTileSize, kMaxLayers, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+
+    size_t budget = kTilesPerFrame;
+    while (budget > 0 && !upload_queue.empty()) {
+        uint32_t id = upload_queue.front();
+        Image& image = images[id];
+
+        if (image.layers.empty() && !reserve_layers(id, image)) {
+            // Out of layers that can be evicted this frame; retry on the next one.
+            if (image.state == State::kFailed) upload_queue.pop_front();
+            break;
+        }
+
+        size_t tiles_x = (image.width + kTileSize - 1) / kTileSize;
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, image.width);
+        while (budget > 0 && image.tiles_uploaded < image.layers.size()) {
+            size_t tile = image.tiles_uploaded;
+            GLint x = GLint(tile % tiles_x) * kTileSize;
+            GLint y = GLint(tile / tiles_x) * kTileSize;
+            GLsizei width = std::min<GLsizei>(kTileSize, image.width - x);
+            GLsizei height = std::min<GLsizei>(kTileSize, image.height - y);
+
+            const uint8_t* pixels = &image.pixels[(size_t(y) * image.width + x) * 4];
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, image.layers[tile], width, height, 1,
+                            GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+            image.tiles_uploaded++;
+            uploaded_tile_count++;
+            budget--;
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+        if (image.tiles_uploaded == image.layers.size()) {
+            // Only the encoded data is kept around, in case the image gets evicted.
+            image.pixels.clear();
+            image.pixels.shrink_to_fit();
+            image.state = State::kResident;
+            image.last_used = frame;
+            resident_generation++;
+            upload_queue.pop_front();
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return generation != resident_generation;
+}
+
+void ImageCache::mark_used(const std::vector<ImagePlacement>& placements) {
+    for (const ImagePlacement& placement : placements) {
+        auto it = images.find(placement.image_id);
+        if (it != images.end()) it->second.last_used = frame;
+    }
+}
+
+uint32_t ImageCache::rows_covered(const ImagePlacement& placement, GLfloat cell_height) const {
+    if (placement.rows) return placement.rows;
+    auto it = images.find(placement.image_id);
+    if (it == images.end() || it->second.height == 0) return 1;
+    return uint32_t(std::ceil(it->second.height / cell_height));
+}
+
+void ImageCache::draw(const std::vector<ImagePlacement>& placements, const GLfloat projection[4],
+                      GLfloat cell_width, GLfloat cell_height) {
+    std::vector<ImageInstance> instances;
+    for (const ImagePlacement& placement : placements) {
+        auto it = images.find(placement.image_id);
+        if (it == images.end()) continue;
+
+        Image& image = it->second;
+        if (image.state == State::kEvicted) queue_decode(placement.image_id, image);
+        if (image.state != State::kResident) continue;
+        image.last_used = frame;
+
+        GLfloat x = placement.col * cell_width;
+        GLfloat y = placement.row * cell_height;
+        GLfloat width = placement.columns ? placement.columns * cell_width : image.width;
+        GLfloat height = placement.rows ? placement.rows * cell_height : image.height;
+        GLfloat scale_x = width / image.width;
+        GLfloat scale_y = height / image.height;
+
+        size_t tiles_x = (image.width + kTileSize - 1) / kTileSize;
+        for (size_t tile = 0; tile < image.layers.size(); tile++) {
+            GLfloat tile_x = GLfloat(tile % tiles_x) * kTileSize;
+            GLfloat tile_y = GLfloat(tile / tiles_x) * kTileSize;
+            GLfloat tile_width = std::min<GLfloat>(kTileSize, image.width - tile_x);
+            GLfloat tile_height = std::min<GLfloat>(kTileSize, image.height - tile_y);
+
+            instances.push_back(ImageInstance{
+                x + tile_x * scale_x, y + tile_y * scale_y, tile_width * scale_x,
+                tile_height * scale_y, tile_width / kTileSize, tile_height / kTileSize,
+                GLfloat(image.layers[tile])});
+        }
+    }
+    if (instances.empty()) return;
+
+    // Decoded pixels are premultiplied.
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(program);
+    glUniform4fv(u_projection, 1, projection);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+
+    for (size_t start = 0; start < instances.size(); start += kMaxInstances) {
+        size_t count = std::min(instances.size() - start, kMaxInstances);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(ImageInstance), &instances[start]);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glBlendFunc(GL_SRC1_COLOR, GL_ONE_MINUS_SRC1_COLOR);
+}
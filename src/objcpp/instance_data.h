@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+// Glyph programs, which differ only in how the atlas is sampled.
+enum ShaderVariant : uint16_t {
+    // Subpixel coverage masks, blended with the text color per channel.
+    kTextVariant = 0,
+    // Premultiplied color bitmaps such as emoji.
+    kColorVariant = 1,
+    kVariantCount = 2,
+};
+
+struct InstanceData {
+    uint16_t col;
+    uint16_t row;
+
+    int16_t left;
+    int16_t top;
+    int16_t width;
+    int16_t height;
+
+    float uv_left;
+    float uv_bot;
+    float uv_width;
+    float uv_height;
+
+    // Not read by the shaders; instances are sorted into draw calls by them.
+    uint16_t atlas_page;
+    uint16_t variant;
+};
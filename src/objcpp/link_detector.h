@@ -0,0 +1,68 @@
+#pragma once
+
+#include "grid.h"
+#include "pane_cache.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Finds URLs in the grid on a worker thread.
+//
+// Only the logical lines touching damaged rows are scanned, including the rows they wrapped onto
+// and from, so the cost follows the amount of new output rather than the size of the screen.
+// Results are stored as per-row spans that the decoration pass draws.
+class LinkDetector {
+public:
+    // `on_detected` is invoked on the worker thread whenever results are ready to be collected.
+    explicit LinkDetector(std::function<void()> on_detected);
+    ~LinkDetector();
+
+    LinkDetector(const LinkDetector&) = delete;
+    LinkDetector& operator=(const LinkDetector&) = delete;
+
+    // Queues the lines of `grid` touching the rows in `damage`. Returns the number of rows queued.
+    size_t scan(size_t pane_index, Grid& grid, const std::vector<uint16_t>& damage);
+
+    // Stores finished results in their rows, following rows that scrolled up meanwhile, and
+    // damages the rows whose links changed. Results for rows queued again since are dropped.
+    void collect(std::vector<Pane>& panes);
+
+private:
+    struct Line {
+        uint16_t first_row;
+        // `link_version` of every row in the line at the time it was queued.
+        std::vector<uint32_t> versions;
+        std::vector<char32_t> text;
+    };
+
+    struct Job {
+        size_t pane_index;
+        uint16_t columns;
+        std::vector<Line> lines;
+    };
+
+    struct RowLinks {
+        size_t pane_index;
+        uint16_t row;
+        uint32_t version;
+        std::vector<LinkSpan> links;
+    };
+
+    void detect_loop();
+
+    // Last request identifier handed out; never zero once a row was queued.
+    uint32_t last_version = 0;
+
+    std::function<void()> on_detected;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<Job> jobs;
+    std::vector<RowLinks> results;
+    bool stopping = false;
+    std::thread worker;
+};
@@ -0,0 +1,201 @@
+#import "link_detector.h"
+#import <algorithm>
+#import <cstring>
+
+namespace {
+
+// Schemes that start a link, including what has to follow the colon.
+constexpr const char* kSchemes[] = {
+    "https://", "http://", "file://", "ftp://", "ssh://", "git://", "mailto:",
+};
+
+bool is_scheme_char(char32_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Characters that end a link, besides whitespace and control characters.
+bool is_delimiter(char32_t c) {
+    return c <= U' ' || c == 0x7F || c == U'<' || c == U'>' || c == U'"' || c == U'`' ||
+           c == U'{' || c == U'}' || c == U'|' || c == U'\\' || c == U'^';
+}
+
+// Returns the length of the scheme prefix starting at `start`, or zero.
+size_t match_scheme(const std::vector<char32_t>& text, size_t start) {
+    for (const char* scheme : kSchemes) {
+        size_t length = strlen(scheme);
+        if (start + length > text.size()) continue;
+
+        bool matches = true;
+        for (size_t i = 0; i < length && matches; i++) {
+            char32_t c = text[start + i];
+            if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+            matches = c == char32_t(scheme[i]);
+        }
+        if (matches) return length;
+    }
+    return 0;
+}
+
+// Finds links in a logical line, as [start, end) offsets into `text`.
+std::vector<std::pair<size_t, size_t>> find_links(const std::vector<char32_t>& text) {
+    std::vector<std::pair<size_t, size_t>> links;
+
+    size_t i = 0;
+    while (i < text.size()) {
+        // A scheme has to start a word.
+        if (!is_scheme_char(text[i]) || (i > 0 && is_scheme_char(text[i - 1]))) {
+            i++;
+            continue;
+        }
+        size_t prefix = match_scheme(text, i);
+        if (prefix == 0) {
+            i++;
+            continue;
+        }
+
+        size_t end = i + prefix;
+        while (end < text.size() && !is_delimiter(text[end])) end++;
+
+        // Trailing punctuation usually belongs to the surrounding sentence, and so do closing
+        // brackets without an opening one in the link.
+        while (end > i + prefix) {
+            char32_t last = text[end - 1];
+            if (last == U'.' || last == U',' || last == U':' || last == U';' || last == U'!' ||
+                last == U'?' || last == U'\'') {
+                end--;
+            } else if (last == U')' || last == U']') {
+                char32_t open = last == U')' ? U'(' : U'[';
+                auto first = text.begin() + i;
+                auto last_it = text.begin() + end;
+                if (std::count(first, last_it, open) >= std::count(first, last_it, last)) break;
+                end--;
+            } else {
+                break;
+            }
+        }
+
+        if (end > i + prefix) links.emplace_back(i, end);
+        i = std::max(end, i + 1);
+    }
+    return links;
+}
+
+}
+
+LinkDetector::LinkDetector(std::function<void()> on_detected)
+    : on_detected(std::move(on_detected)) {
+    worker = std::thread(&LinkDetector::detect_loop, this);
+}
+
+LinkDetector::~LinkDetector() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_one();
+    worker.join();
+}
+
+size_t LinkDetector::scan(size_t pane_index, Grid& grid, const std::vector<uint16_t>& damage) {
+    // First rows of the logical lines touching the damage.
+    std::vector<uint16_t> starts;
+    for (uint16_t row : damage) {
+        if (row >= grid.rows.size()) continue;
+        uint16_t start = row;
+        while (start > 0 && grid.rows[start - 1].wrapped) start--;
+        starts.push_back(start);
+    }
+    if (starts.empty()) return 0;
+    std::sort(starts.begin(), starts.end());
+    starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+
+    Job job{pane_index, grid.columns, {}};
+    size_t rows_queued = 0;
+    for (uint16_t start : starts) {
+        Line line{start, {}, {}};
+        size_t row = start;
+        while (true) {
+            Row& current = grid.rows[row];
+            current.link_version = ++last_version;
+            line.versions.push_back(current.link_version);
+            for (const Cell& cell : current.cells) line.text.push_back(cell.codepoint);
+            rows_queued++;
+
+            if (!current.wrapped || row + 1 == grid.rows.size()) break;
+            row++;
+        }
+        job.lines.push_back(std::move(line));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    condition.notify_one();
+    return rows_queued;
+}
+
+void LinkDetector::collect(std::vector<Pane>& panes) {
+    std::vector<RowLinks> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.swap(results);
+    }
+
+    for (RowLinks& result : finished) {
+        if (result.pane_index >= panes.size()) continue;
+        Grid& grid = panes[result.pane_index].grid;
+
+        // Rows only move up, when the grid scrolls.
+        size_t index = std::min(size_t(result.row) + 1, grid.rows.size());
+        while (index > 0 && grid.rows[index - 1].link_version != result.version) index--;
+        if (index == 0) continue;
+        index--;
+
+        Row& row = grid.rows[index];
+        if (row.links == result.links) continue;
+        row.links = std::move(result.links);
+        panes[result.pane_index].damage.push_back(index);
+    }
+}
+
+void LinkDetector::detect_loop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) return;
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        std::vector<RowLinks> rows;
+        for (const Line& line : job.lines) {
+            size_t first_result = rows.size();
+            for (size_t i = 0; i < line.versions.size(); i++) {
+                rows.push_back(RowLinks{job.pane_index, uint16_t(line.first_row + i),
+                                        line.versions[i], {}});
+            }
+
+            // Links wrapped across rows get a span in every row they cover.
+            for (auto [start, end] : find_links(line.text)) {
+                for (size_t offset = start; offset < end;) {
+                    size_t row = offset / job.columns;
+                    size_t row_end = std::min(end, (row + 1) * job.columns);
+                    rows[first_result + row].links.push_back(
+                        LinkSpan{uint16_t(offset % job.columns),
+                                 uint16_t(row_end - row * job.columns)});
+                    offset = row_end;
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (RowLinks& row : rows) results.push_back(std::move(row));
+        }
+        if (on_detected) on_detected();
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "grid.h"
+#include "image_cache.h"
+#include "instance_data.h"
+#include "shader.h"
+#include <OpenGL/gl3.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct Pane {
+    // Bounds in window pixels, relative to the top left corner of the window.
+    GLint x;
+    GLint y;
+    GLsizei width;
+    GLsizei height;
+
+    Grid grid;
+    std::vector<InstanceData> instances;
+    std::vector<ImagePlacement> images;
+
+    // Rows whose instances changed since the pane was last rendered.
+    std::vector<uint16_t> damage;
+
+    // Hash of `instances`, `images` and the grid's links, only refreshed while the pane is damaged.
+    uint64_t content_hash = 0;
+};
+
+// Offscreen color targets holding the last rendered output of every pane.
+//
+// A pane is only rendered into its target again when its damage set is non-empty; otherwise the
+// cached output is composited into the window with a single textured quad.
+class PaneCache {
+public:
+    PaneCache();
+    ~PaneCache();
+
+    PaneCache(const PaneCache&) = delete;
+    PaneCache& operator=(const PaneCache&) = delete;
+
+    // Binds the target of the pane at `index` for rendering and returns true, or returns false
+    // without binding anything when its cached output is still valid.
+    bool begin(size_t index, const Pane& pane);
+
+    void composite(const std::vector<Pane>& panes, GLsizei window_width, GLsizei window_height);
+
+    // Waits for the composite program, which starts compiling on construction.
+    void link();
+
+    // Issues a composite draw into the currently bound framebuffer, so the driver finishes compiling
+    // the program before the first real frame.
+    void warm_up();
+
+    // Forgets every target and starts compiling the program again in the now current context.
+    void context_lost();
+
+private:
+    void setup();
+
+    struct Target {
+        GLuint fbo = 0;
+        GLuint texture = 0;
+        GLsizei width = 0;
+        GLsizei height = 0;
+        bool valid = false;
+    };
+
+    std::vector<Target> targets;
+
+    PendingProgram pending_program;
+    GLuint program = 0;
+    GLuint vao;
+    GLint u_rect;
+};
@@ -0,0 +1,140 @@
+#import "pane_cache.h"
+#import "shader.h"
+
+PaneCache::PaneCache() {
+    setup();
+}
+
+void PaneCache::setup() {
+    const GLchar* vertSource = R"(
+    #version 330 core
+
+// Left, top, right and bottom edge in normalized device coordinates.
+uniform vec4 rect;
+
+out vec2 TexCoords;
+
+void main() {
+    vec2 position = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+
+    // Panes are rendered top-down, so the top edge samples the last texture row.
+    TexCoords = vec2(position.x, 1.0 - position.y);
+    gl_Position = vec4(mix(rect.xy, rect.zw, position), 0.0, 1.0);
+}
+)";
+    const GLchar* fragSource = R"(
+    #version 330 core
+
+in vec2 TexCoords;
+
+out vec4 color;
+
+uniform sampler2D pane;
+
+void main() {
+    color = texture(pane, TexCoords);
+}
+)";
+    pending_program = begin_program("pane composite", vertSource, fragSource);
+
+    // Core profiles refuse to draw without a bound vertex array, even when no attributes are used.
+    glGenVertexArrays(1, &vao);
+}
+
+void PaneCache::link() {
+    program = finish_program(pending_program);
+    u_rect = glGetUniformLocation(program, "rect");
+}
+
+PaneCache::~PaneCache() {
+    for (Target& target : targets) {
+        glDeleteFramebuffers(1, &target.fbo);
+        glDeleteTextures(1, &target.texture);
+    }
+    glDeleteVertexArrays(1, &vao);
+    glDeleteProgram(program);
+}
+
+bool PaneCache::begin(size_t index, const Pane& pane) {
+    if (targets.size() <= index) targets.resize(index + 1);
+    Target& target = targets[index];
+
+    if (target.width != pane.width || target.height != pane.height) {
+        if (!target.fbo) {
+            glGenFramebuffers(1, &target.fbo);
+            glGenTextures(1, &target.texture);
+        }
+
+        glBindTexture(GL_TEXTURE_2D, target.texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, pane.width, pane.height, 0, GL_RGBA,
+                     GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture,
+                               0);
+
+        target.width = pane.width;
+        target.height = pane.height;
+        target.valid = false;
+    }
+
+    if (target.valid && pane.damage.empty()) return false;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glViewport(0, 0, target.width, target.height);
+    target.valid = true;
+    return true;
+}
+
+void PaneCache::composite(const std::vector<Pane>& panes, GLsizei window_width,
+                          GLsizei window_height) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, window_width, window_height);
+    // Fills the padding around the panes with the current clear color; it would otherwise show
+    // whatever the back buffer held last.
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // Pane targets are opaque, so there is nothing to blend against.
+    glDisable(GL_BLEND);
+    glUseProgram(program);
+    glBindVertexArray(vao);
+    glActiveTexture(GL_TEXTURE0);
+
+    for (size_t i = 0; i < panes.size() && i < targets.size(); i++) {
+        const Pane& pane = panes[i];
+        float left = 2.0f * pane.x / window_width - 1.0f;
+        float top = 1.0f - 2.0f * pane.y / window_height;
+        float right = 2.0f * (pane.x + pane.width) / window_width - 1.0f;
+        float bottom = 1.0f - 2.0f * (pane.y + pane.height) / window_height;
+
+        glUniform4f(u_rect, left, top, right, bottom);
+        glBindTexture(GL_TEXTURE_2D, targets[i].texture);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glEnable(GL_BLEND);
+}
+
+void PaneCache::warm_up() {
+    glDisable(GL_BLEND);
+    glUseProgram(program);
+    glBindVertexArray(vao);
+    glUniform4f(u_rect, -1.0, 1.0, 1.0, -1.0);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glEnable(GL_BLEND);
+}
+
+void PaneCache::context_lost() {
+    targets.clear();
+    setup();
+}
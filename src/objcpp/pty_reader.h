@@ -0,0 +1,85 @@
+#pragma once
+
+#include "byte_ring.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <thread>
+
+// Runs a program on a pseudo terminal and reads its output on a thread of its own.
+//
+// The reader `readv`s straight into the free space of a large ring, as much as the terminal has
+// queued at once, and the parser consumes the ring in place. When the parser falls behind and the
+// ring fills up, the reader stops reading until space frees up, so the kernel's terminal buffer
+// fills in turn and the program blocks on its writes instead of output piling up in memory.
+class PtyReader {
+public:
+    // Starts `program` as a login shell on a new terminal of `columns` x `rows` cells. Returns
+    // nullptr when either cannot be created. `on_output` is invoked on the reader thread when
+    // output arrives while none was waiting to be consumed.
+    static std::unique_ptr<PtyReader> spawn(const char* program, uint16_t columns, uint16_t rows,
+                                            std::function<void()> on_output);
+    ~PtyReader();
+
+    PtyReader(const PtyReader&) = delete;
+    PtyReader& operator=(const PtyReader&) = delete;
+
+    // Passes queued output to `parse`, in place, until `budget` bytes were consumed. Returns the
+    // bytes consumed; `on_output` is invoked again when more is left.
+    size_t consume(size_t budget, const std::function<void(const uint8_t*, size_t)>& parse);
+
+    void resize(uint16_t columns, uint16_t rows);
+
+    // Whether the program closed the terminal and all of its output was consumed. Consumer
+    // thread only.
+    bool exited() const;
+
+    // Bytes read, `readv` calls it took, and times the reader waited for the parser because the
+    // ring was full.
+    uint64_t bytes_read() const {
+        return read_bytes.load(std::memory_order_relaxed);
+    }
+
+    uint64_t reads() const {
+        return read_count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t stalls() const {
+        return stall_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    PtyReader(int master, pid_t child, int stop_read, int stop_write,
+              std::function<void()> on_output);
+    void read_loop();
+    bool wait_for_space();
+    void wake();
+
+    int master;
+    pid_t child;
+    // Written to when the reader has to stop while it waits for output.
+    int stop_read;
+    int stop_write;
+
+    ByteRing ring;
+    std::function<void()> on_output;
+    // Set from when `on_output` is invoked until the consumer starts draining the ring, so a
+    // burst of reads wakes the consumer once.
+    std::atomic<bool> wake_pending{false};
+    std::atomic<bool> child_exited{false};
+
+    std::atomic<uint64_t> read_bytes{0};
+    std::atomic<uint64_t> read_count{0};
+    std::atomic<uint64_t> stall_count{0};
+
+    std::mutex mutex;
+    std::condition_variable space;
+    std::atomic<bool> waiting_for_space{false};
+    bool stopping = false;
+    std::thread reader;
+};
@@ -0,0 +1,184 @@
+#import "pty_reader.h"
+#import <algorithm>
+#import <cerrno>
+#import <csignal>
+#import <cstdlib>
+#import <cstring>
+#import <fcntl.h>
+#import <poll.h>
+#import <string>
+#import <sys/ioctl.h>
+#import <sys/wait.h>
+#import <unistd.h>
+#import <util.h>
+#import <vector>
+
+extern char** environ;
+
+namespace {
+
+// 4 MiB, several seconds of output for anything a person reads and a few frames' worth of floods.
+constexpr size_t kRingSize = size_t(1) << 22;
+
+// Time a hung up program gets to exit before it is killed.
+constexpr int kHangupWaits = 100;
+
+// Collects the exit status of `child`, killing it when it outlives the hangup.
+void reap(pid_t child) {
+    for (int i = 0; i < kHangupWaits; i++) {
+        if (waitpid(child, nullptr, WNOHANG) != 0) return;
+        usleep(1000);
+    }
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+}
+
+}
+
+std::unique_ptr<PtyReader> PtyReader::spawn(const char* program, uint16_t columns, uint16_t rows,
+                                            std::function<void()> on_output) {
+    int stop_pipe[2];
+    if (pipe(stop_pipe) != 0) return nullptr;
+    fcntl(stop_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(stop_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    // Everything the child needs is prepared here, since other threads may hold locks at the
+    // fork that it would never get back; after it, only async-signal-safe calls are made. The
+    // grid only understands plain text and a few control characters so far.
+    std::vector<std::string> variables = {"TERM=dumb"};
+    for (char** variable = environ; *variable; variable++) {
+        if (strncmp(*variable, "TERM=", 5) != 0) variables.push_back(*variable);
+    }
+    std::vector<char*> envp;
+    for (std::string& variable : variables) envp.push_back(variable.data());
+    envp.push_back(nullptr);
+    char* argv[] = {const_cast<char*>(program), const_cast<char*>("-l"), nullptr};
+
+    winsize size = {rows, columns, 0, 0};
+    int master = -1;
+    pid_t child = forkpty(&master, nullptr, nullptr, &size);
+    if (child == 0) {
+        execve(program, argv, envp.data());
+        _exit(127);
+    }
+    if (child < 0) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        return nullptr;
+    }
+
+    fcntl(master, F_SETFD, FD_CLOEXEC);
+    return std::unique_ptr<PtyReader>(
+        new PtyReader(master, child, stop_pipe[0], stop_pipe[1], std::move(on_output)));
+}
+
+PtyReader::PtyReader(int master, pid_t child, int stop_read, int stop_write,
+                     std::function<void()> on_output)
+    : master(master),
+      child(child),
+      stop_read(stop_read),
+      stop_write(stop_write),
+      ring(kRingSize),
+      on_output(std::move(on_output)) {
+    reader = std::thread(&PtyReader::read_loop, this);
+}
+
+PtyReader::~PtyReader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    space.notify_one();
+    char byte = 0;
+    (void)write(stop_write, &byte, 1);
+    reader.join();
+
+    // Closing the terminal hangs the program up.
+    close(master);
+    close(stop_read);
+    close(stop_write);
+    kill(child, SIGHUP);
+    reap(child);
+}
+
+void PtyReader::read_loop() {
+    while (true) {
+        iovec spans[2];
+        if (ring.writable(spans) == 0) {
+            if (!wait_for_space()) return;
+            continue;
+        }
+
+        pollfd fds[2] = {{master, POLLIN, 0}, {stop_read, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) return;
+
+        ssize_t bytes = readv(master, spans, spans[1].iov_len ? 2 : 1);
+        if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        // The terminal reports EIO once the program and all its children closed it.
+        if (bytes <= 0) break;
+
+        ring.commit_write(size_t(bytes));
+        read_bytes.fetch_add(uint64_t(bytes), std::memory_order_relaxed);
+        read_count.fetch_add(1, std::memory_order_relaxed);
+        wake();
+    }
+
+    // The program is reaped by the destructor, which the consumer runs once it saw the exit.
+    child_exited.store(true, std::memory_order_release);
+    if (on_output) on_output();
+}
+
+// Blocks until the consumer freed space in the ring. Returns false when stopping instead.
+bool PtyReader::wait_for_space() {
+    stall_count.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting_for_space.store(true);
+    // Pairs with the fence in `consume`: either it sees the flag, or this sees its progress.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    iovec spans[2];
+    space.wait(lock, [&] { return stopping || ring.writable(spans) != 0; });
+    waiting_for_space.store(false);
+    return !stopping;
+}
+
+void PtyReader::wake() {
+    if (!wake_pending.exchange(true) && on_output) on_output();
+}
+
+size_t PtyReader::consume(size_t budget,
+                          const std::function<void(const uint8_t*, size_t)>& parse) {
+    // Output arriving from here on wakes the consumer again.
+    wake_pending.store(false);
+
+    size_t consumed = 0;
+    iovec spans[2];
+    while (consumed < budget && ring.readable(spans) != 0) {
+        size_t bytes = std::min(spans[0].iov_len, budget - consumed);
+        parse(static_cast<const uint8_t*>(spans[0].iov_base), bytes);
+        ring.commit_read(bytes);
+        consumed += bytes;
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting_for_space.load()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            space.notify_one();
+        }
+    }
+
+    if (ring.readable(spans) != 0) wake();
+    return consumed;
+}
+
+bool PtyReader::exited() const {
+    iovec spans[2];
+    return child_exited.load(std::memory_order_acquire) && ring.readable(spans) == 0;
+}
+
+void PtyReader::resize(uint16_t columns, uint16_t rows) {
+    winsize size = {rows, columns, 0, 0};
+    ioctl(master, TIOCSWINSZ, &size);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "font_file.h"
+#include "glyph.h"
+#include <CoreText/CoreText.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Cell size derived from the primary font, in pixels.
+struct CellMetrics {
+    float width;
+    float height;
+    // Distance from the bottom of the cell up to the baseline.
+    int16_t baseline;
+};
+
+// Draws the glyphs of one face at one pixel size with CoreText.
+//
+// CoreText fonts are immutable, so a rasterizer can be shared by any number of threads; every call
+// draws into a bitmap context of its own.
+class Rasterizer {
+public:
+    // Draws `file` straight from its mapping, and maps codepoints through its compiled cmap.
+    Rasterizer(std::shared_ptr<const FontFile> file, float pixel_size);
+    // Draws the installed font with PostScript or family `name`, for faces missing from the index.
+    Rasterizer(const std::string& name, float pixel_size);
+    ~Rasterizer();
+
+    Rasterizer(const Rasterizer&) = delete;
+    Rasterizer& operator=(const Rasterizer&) = delete;
+
+    // Returns 0 (.notdef) when the face has no glyph for `c`.
+    uint32_t glyph_index(char32_t c) const;
+
+    // Rasterizes `glyph` as coverage into `pixels`, with its top relative to the baseline, which
+    // depends on the cell and so is left to the caller. Glyphs without ink have an empty bitmap.
+    RasterizedGlyph rasterize(uint32_t glyph, std::vector<uint8_t>* pixels) const;
+
+    GlyphKey key(uint32_t glyph) const;
+
+    // Cells fit the advance of '0' and the face's line height.
+    CellMetrics cell_metrics() const;
+
+    float pixel_size() const {
+        return size;
+    }
+
+private:
+    std::shared_ptr<const FontFile> font_file;
+    CTFontRef font = nullptr;
+    float size;
+    uint64_t font_hash;
+};
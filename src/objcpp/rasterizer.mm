@@ -0,0 +1,139 @@
+#import "rasterizer.h"
+#import "hash.h"
+#import <cmath>
+#import <utility>
+
+namespace {
+
+// Antialiased edges can reach a pixel past the glyph's bounding box.
+constexpr int kPadding = 1;
+
+CTFontRef create_font(const FontFile& file, float pixel_size) {
+    // Graphics fonts only read the first face of a collection, so other faces are looked up by
+    // name instead.
+    if (file.face_index() != 0) {
+        std::string name = file.name(6);
+        CFStringRef ps_name = CFStringCreateWithCString(nullptr, name.c_str(),
+                                                        kCFStringEncodingUTF8);
+        if (!ps_name) return nullptr;
+        CTFontRef font = CTFontCreateWithName(ps_name, pixel_size, nullptr);
+        CFRelease(ps_name);
+        return font;
+    }
+
+    // The provider reads the existing mapping, which the rasterizer keeps alive.
+    FontData data = file.file();
+    CGDataProviderRef provider = CGDataProviderCreateWithData(nullptr, data.data, data.size,
+                                                              nullptr);
+    CGFontRef graphics_font = CGFontCreateWithDataProvider(provider);
+    CGDataProviderRelease(provider);
+    if (!graphics_font) return nullptr;
+
+    CTFontRef font = CTFontCreateWithGraphicsFont(graphics_font, pixel_size, nullptr, nullptr);
+    CGFontRelease(graphics_font);
+    return font;
+}
+
+}
+
+Rasterizer::Rasterizer(std::shared_ptr<const FontFile> file, float pixel_size)
+    : font_file(std::move(file)), size(pixel_size), font_hash(font_file->hash()) {
+    font = create_font(*font_file, pixel_size);
+}
+
+Rasterizer::Rasterizer(const std::string& name, float pixel_size)
+    : size(pixel_size), font_hash(hash_bytes(name.data(), name.size())) {
+    CFStringRef font_name = CFStringCreateWithCString(nullptr, name.c_str(),
+                                                      kCFStringEncodingUTF8);
+    if (font_name) {
+        font = CTFontCreateWithName(font_name, pixel_size, nullptr);
+        CFRelease(font_name);
+    }
+}
+
+Rasterizer::~Rasterizer() {
+    if (font) CFRelease(font);
+}
+
+uint32_t Rasterizer::glyph_index(char32_t c) const {
+    if (font_file) return font_file->glyph_index(c);
+    if (!font) return 0;
+
+    UniChar units[2];
+    CFIndex count = 1;
+    if (c >= 0x10000) {
+        units[0] = UniChar(0xD800 + ((c - 0x10000) >> 10));
+        units[1] = UniChar(0xDC00 + ((c - 0x10000) & 0x3FF));
+        count = 2;
+    } else {
+        units[0] = UniChar(c);
+    }
+    CGGlyph glyphs[2] = {};
+    return CTFontGetGlyphsForCharacters(font, units, glyphs, count) ? glyphs[0] : 0;
+}
+
+RasterizedGlyph Rasterizer::rasterize(uint32_t glyph, std::vector<uint8_t>* pixels) const {
+    RasterizedGlyph out{0, 0, 0, 0, nullptr};
+    if (!font) return out;
+
+    CGGlyph cg_glyph = CGGlyph(glyph);
+    CGRect bounds;
+    CTFontGetBoundingRectsForGlyphs(font, kCTFontOrientationHorizontal, &cg_glyph, &bounds, 1);
+    if (bounds.size.width <= 0 || bounds.size.height <= 0) return out;
+
+    int left = int(std::floor(bounds.origin.x)) - kPadding;
+    int bottom = int(std::floor(bounds.origin.y)) - kPadding;
+    int right = int(std::ceil(bounds.origin.x + bounds.size.width)) + kPadding;
+    int top = int(std::ceil(bounds.origin.y + bounds.size.height)) + kPadding;
+    size_t width = size_t(right - left);
+    size_t height = size_t(top - bottom);
+
+    std::vector<uint8_t> coverage(width * height, 0);
+    CGColorSpaceRef gray = CGColorSpaceCreateDeviceGray();
+    CGContextRef context = CGBitmapContextCreate(coverage.data(), width, height, 8, width, gray,
+                                                 kCGImageAlphaNone);
+    CGColorSpaceRelease(gray);
+    if (!context) return out;
+
+    CGContextSetAllowsAntialiasing(context, true);
+    CGContextSetShouldAntialias(context, true);
+    CGContextSetGrayFillColor(context, 1.0, 1.0);
+    CGPoint origin = {CGFloat(-left), CGFloat(-bottom)};
+    CTFontDrawGlyphs(font, &cg_glyph, &origin, 1, context);
+    CGContextRelease(context);
+
+    // Text is blended per channel, so grayscale coverage is repeated into all three.
+    pixels->resize(width * height * 3);
+    for (size_t i = 0; i < coverage.size(); i++) {
+        (*pixels)[i * 3] = coverage[i];
+        (*pixels)[i * 3 + 1] = coverage[i];
+        (*pixels)[i * 3 + 2] = coverage[i];
+    }
+
+    out.left = int16_t(left);
+    out.top = int16_t(top);
+    out.width = int16_t(width);
+    out.height = int16_t(height);
+    out.buffer = pixels->data();
+    return out;
+}
+
+GlyphKey Rasterizer::key(uint32_t glyph) const {
+    return GlyphKey{font_hash, glyph, uint32_t(std::lround(size * 64)), 0};
+}
+
+CellMetrics Rasterizer::cell_metrics() const {
+    if (!font) return CellMetrics{size / 2, size, 0};
+
+    CGGlyph zero = CGGlyph(glyph_index(U'0'));
+    CGSize advance = {0, 0};
+    CTFontGetAdvancesForGlyphs(font, kCTFontOrientationHorizontal, &zero, &advance, 1);
+
+    // Fonts without digits still get usable cells.
+    float width = float(std::round(advance.width));
+    if (width < 1) width = std::ceil(size / 2);
+
+    CGFloat descent = CTFontGetDescent(font);
+    CGFloat line_height = CTFontGetAscent(font) + descent + CTFontGetLeading(font);
+    return CellMetrics{width, float(std::ceil(line_height)), int16_t(std::ceil(descent))};
+}
@@ -1,2 +1,136 @@
-void draw();
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct RendererStats {
+    // Frames submitted to the GPU and presented.
+    uint64_t frames_drawn;
+    // Redraw requests dropped because the frame inputs were unchanged.
+    uint64_t frames_skipped;
+    // Panes rendered into their offscreen target because they were damaged.
+    uint64_t panes_rendered;
+    // Panes composited from their offscreen target.
+    uint64_t panes_composited;
+    // Inline image tiles uploaded, and images evicted to stay within the texture budget.
+    uint64_t image_tiles_uploaded;
+    uint64_t image_evictions;
+    // GL context replacements the atlas was restored from its CPU shadow for.
+    uint64_t context_recoveries;
+    // Bytes the atlas shadow holds compressed, and the bitmaps it restores take uncompressed.
+    uint64_t atlas_shadow_bytes;
+    uint64_t atlas_raw_bytes;
+    // Time spent on the warm-up draws that force the driver to compile every program.
+    uint64_t shader_warmup_us;
+    // Frames read back for capture, and captures dropped because every readback was in flight.
+    uint64_t frames_captured;
+    uint64_t captures_dropped;
+    // Grid rows queued for hyperlink detection because they, or a row wrapped with them, changed.
+    uint64_t link_rows_scanned;
+    // Color emoji decoded and scaled to the cell height.
+    uint64_t emoji_decoded;
+    // Time from the first startup phase to the first presented frame, and how much of it the
+    // renderer spent waiting for the font workers.
+    uint64_t startup_us;
+    uint64_t font_wait_us;
+    // Glyphs uploaded on the upload thread, and frames that had to wait for it to issue the
+    // uploads of glyphs they draw, with the total time spent waiting.
+    uint64_t glyphs_uploaded_async;
+    uint64_t upload_stalls;
+    uint64_t upload_stall_us;
+    // Atlas pages evicted to stay within the page budget, and times reusing one had to wait for
+    // the GPU to finish a frame that read it.
+    uint64_t atlas_evictions;
+    uint64_t reclaim_waits;
+    // Glyph cache versions published, each carrying the glyphs inserted while building a frame.
+    uint64_t glyph_snapshots;
+    // Cells instances were built for, and blank ones among them that got no instance.
+    uint64_t cells_built;
+    uint64_t blank_cells_elided;
+    // Rows whose instances were copied from the row cache, rows built from their cells, and the
+    // memory the cache holds.
+    uint64_t row_cache_hits;
+    uint64_t row_cache_misses;
+    uint64_t row_cache_bytes;
+    // Times output floods switched throughput mode on or off, and redraws it put off.
+    uint64_t throughput_switches;
+    uint64_t frames_deferred;
+    // Shell output read, the reads it took, and times the reader stopped because the parser fell
+    // a whole ring behind.
+    uint64_t pty_bytes_read;
+    uint64_t pty_reads;
+    uint64_t pty_backpressure_waits;
+};
+
+// Files captured frames are written to besides being passed to the callback.
+enum CaptureFormat {
+    kCaptureNone,
+    // Tightly packed RGBA rows, top row first, in `<prefix>-<frame>-<width>x<height>.rgba`.
+    kCaptureRaw,
+    // `<prefix>-<frame>.png`.
+    kCapturePng,
+};
+
+// Receives a captured frame on a worker thread, a few frames after it was drawn. `pixels` holds
+// RGBA rows, top row first, and is only valid during the call.
+typedef void (*FrameCallback)(void* data, uint64_t frame, uint32_t width, uint32_t height,
+                              const uint8_t* pixels);
+
+// Starts loading the primary font and rasterizing ASCII on worker threads for a display with
+// `scale_factor` pixels per point. Meant to be called before the window and context are created,
+// so that work overlaps with it; `prewarm_shaders` waits for the workers.
+void preload_fonts(float scale_factor);
+// Records that a startup phase just finished on the main thread. The timeline is printed with the
+// first frame.
+void mark_startup_phase(const char* phase);
+
+// Returns false without touching the framebuffer when the frame would be identical to the last
+// one, in which case the buffers must not be swapped either.
+bool draw();
+void resize(uint32_t width, uint32_t height);
+// Rebuilds every GL object in the current context, which replaces one that was lost, restoring
+// the atlas from its CPU shadow. Called before drawing into a newly created context.
+void context_lost();
+// Sets up the renderer and compiles every shader variant through an offscreen draw, so the first
+// frame does not pay for it. Expects the context to be current.
+void prewarm_shaders();
+// Microseconds a requested redraw should be put off by, zero when it should be drawn now. Nonzero
+// only while output arrives faster than it can be read, so parsing is not slowed down by frames
+// of intermediate states.
+uint64_t next_frame_delay_us();
+RendererStats renderer_stats();
+
+// Queues an encoded inline image for decoding under `id`, replacing any previous image with it.
+void submit_image(uint32_t id, const uint8_t* data, size_t size);
+// Shows image `id` at a cell, stretched over `columns` x `rows` cells.
+void place_image(uint32_t id, uint16_t col, uint16_t row, uint16_t columns, uint16_t rows);
+
+// Writes UTF-8 output into the grid at the cursor. A sequence split across calls is completed by
+// the next call.
+void write_text(const uint8_t* data, size_t size);
+
+// Decodes `data` as consecutive UTF-8 chunks of `chunk_sizes` bytes through one decoder, the way
+// output is fed to `write_text`. Writes up to `capacity` code points to `out` and returns how many
+// were decoded.
+size_t decode_utf8(const uint8_t* data, const size_t* chunk_sizes, size_t chunk_count,
+                   uint32_t* out, size_t capacity);
+
+// Starts $SHELL on a pseudo terminal sized to the grid. Its output is read on a thread of its own,
+// which wakes the event loop to have `process_output` write it into the grid. Returns false when
+// the shell could not be started.
+bool start_shell();
+// Writes the shell output read so far into the grid, up to a budget per call; the event loop is
+// woken again when output is left. Returns false once the shell exited and all of its output was
+// written.
+bool process_output();
+
+// Captures the next `frame_count` drawn frames, or every frame until `stop_capture` when it is
+// zero. `callback` may be null when the frames only need to be written out.
+void start_capture(enum CaptureFormat format, const char* path_prefix, FrameCallback callback,
+                   void* data, uint32_t frame_count);
+// Returns once every frame captured so far has been delivered, so `data` can be released.
+void stop_capture();
+
+// Registers a callback that makes the event loop redraw. It is called from background threads.
+void set_wakeup_callback(void (*callback)(void* data), void* data);
 void cgl_context();
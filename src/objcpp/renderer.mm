@@ -1,27 +1,203 @@
 #import "renderer.h"
+#import "atlas.h"
+#import "batch.h"
+#import "emoji_cache.h"
+#import "epoch_reclaimer.h"
+#import "font_index.h"
+#import "font_loader.h"
+#import "frame_capture.h"
+#import "glyph_cache.h"
+#import "glyph_uploader.h"
+#import "hash.h"
+#import "image_cache.h"
+#import "instance_data.h"
+#import "link_detector.h"
+#import "pane_cache.h"
+#import "pty_reader.h"
+#import "rasterizer.h"
+#import "row_cache.h"
+#import "shader.h"
+#import "shared_glyph_cache.h"
+#import "startup_timeline.h"
+#import "throughput_mode.h"
+#import "unicode.h"
+#import "utf8.h"
+#import "wakeup.h"
 #import <Cocoa/Cocoa.h>
+#import <CoreText/CoreText.h>
+#import <OpenGL/OpenGL.h>
 #import <OpenGL/gl3.h>
+#import <algorithm>
+#import <chrono>
+#import <cstdlib>
+#import <cstddef>
 #import <cstdint>
+#import <dlfcn.h>
 #import <iostream>
+#import <memory>
+#import <string>
+#import <unordered_map>
 #import <vector>
 
-GLuint setup_shaders();
+PendingProgram setup_shaders(ShaderVariant variant);
 
-struct InstanceData {
-    uint16_t col;
-    uint16_t row;
+// Primary font, looked up in the font index by family.
+constexpr const char* kFontFamily = "Menlo";
+constexpr float kFontPoints = 16;
 
-    int16_t left;
-    int16_t top;
-    int16_t width;
-    int16_t height;
+// Space between the window edges and the grid, in pixels.
+constexpr GLint kPadding = 10;
 
-    float uv_left;
-    float uv_bot;
-    float uv_width;
-    float uv_height;
+// Hyperlink underline, relative to the bottom of the cell.
+constexpr int16_t kUnderlineThickness = 2;
+constexpr int16_t kUnderlineTop = 4;
+
+// Atlas pages, 4 MiB each, kept before the least recently drawn one is evicted.
+constexpr size_t kMaxAtlasPages = 8;
+
+// Memory for reusable row instances, about 30k instances.
+constexpr size_t kRowCacheBytes = 1 << 20;
+
+// Shell output parsed per wakeup, so a flood still lets frames through between batches.
+constexpr size_t kOutputBudget = 1 << 20;
+
+// Rows image placements move up by at most in one scroll, keeping their rows far from overflowing.
+constexpr uint64_t kMaxImageScroll = 1 << 24;
+
+// Initial capacity of the instance buffer, which grows to hold the largest pane.
+constexpr size_t kMaxInstances = 4096;
+
+// Core since GL 4.2, which macOS never shipped, so it is resolved at runtime.
+using DrawElementsInstancedBaseInstanceFn = void (*)(GLenum mode, GLsizei count, GLenum type,
+                                                     const void* indices, GLsizei instancecount,
+                                                     GLuint baseinstance);
+
+class Renderer {
+public:
+    Renderer();
+
+    bool draw();
+    void resize(GLsizei width, GLsizei height);
+
+    // Draws once with every program into an offscreen 1x1 target, since many drivers only finish
+    // compiling shaders on their first use.
+    void warm_up_shaders();
+
+    void submit_image(uint32_t id, std::vector<uint8_t> data);
+    void place_image(const ImagePlacement& placement);
+    void write_text(const uint8_t* data, size_t size);
+
+    bool start_shell();
+    bool process_output();
+
+    void start_capture(CaptureFormat format, std::string path_prefix, FrameCallback callback,
+                       void* callback_data, uint32_t frame_count);
+    void stop_capture();
+
+    uint64_t frame_delay_us() {
+        return throughput_mode.frame_delay_us();
+    }
+
+    void context_lost();
+
+    RendererStats stats() const;
+
+private:
+    void setup_gl();
+    void link_programs();
+    void recover_context();
+    uint64_t hash_frame();
+    void resize_grid(Pane& pane);
+    void build_instances(Pane& pane);
+    void build_decorations(const Pane& pane);
+    void scroll_images(Pane& pane, uint64_t count);
+    bool cell_glyph(char32_t c, Glyph* out, ShaderVariant* variant);
+    bool text_glyph(char32_t c, Glyph* out);
+    bool color_glyph(char32_t c, Glyph* out, bool* missing);
+    const Rasterizer* fallback_rasterizer(char32_t c);
+    void point_instance_attributes(size_t first);
+    void draw_instances(const std::vector<InstanceData>& instances, const GLfloat projection[4]);
+
+    // Context all GL objects below belong to.
+    CGLContextObj context = nullptr;
+
+    GLuint vao = 0;
+    GLuint ebo = 0;
+    GLuint vbo_instance = 0;
+    size_t instance_capacity = 0;
+
+    // Null when the context lacks base instances; draws then move the instance attributes
+    // instead.
+    DrawElementsInstancedBaseInstanceFn draw_base_instance = nullptr;
+
+    PendingProgram pending_programs[kVariantCount] = {};
+    GLuint glyph_programs[kVariantCount] = {};
+    GLint u_projection[kVariantCount] = {};
+
+    GLfloat cell_width = 20.0;
+    GLfloat cell_height = 40.0;
+    int16_t baseline = 0;
+
+    GLsizei window_width = 0;
+    GLsizei window_height = 0;
+
+    // Epochs are the frames drawn; atlas pages are only reused once the frames that read them
+    // completed.
+    EpochReclaimer reclaimer;
+    GlyphCache glyph_cache{reclaimer, kMaxAtlasPages};
+    RowCache row_cache{kRowCacheBytes};
+    // Null unless glyphs are uploaded on a thread of their own. The newest upload ticket among the
+    // glyphs of the instances built for the next frame.
+    std::unique_ptr<GlyphUploader> uploader;
+    uint64_t frame_upload = 0;
+
+    // Reused between draws to sort instances into one draw call per variant and page.
+    std::vector<InstanceData> sorted_instances;
+    std::vector<DrawBucket> draw_buckets;
+
+    std::unique_ptr<Rasterizer> rasterizer;
+    // Faces found through the font index for characters the primary font lacks, by face hash.
+    std::unordered_map<uint64_t, std::unique_ptr<Rasterizer>> fallback_rasterizers;
+    std::vector<uint8_t> glyph_pixels;
+
+    // Null when the system has no color emoji font with PNG strikes.
+    CTFontRef emoji_font = nullptr;
+    std::unique_ptr<EmojiCache> emoji_cache;
+
+    // Solid bitmap that decorations are stretched from.
+    Glyph underline_glyph = {};
+    std::vector<InstanceData> decorations;
+
+    std::vector<Pane> panes;
+    Utf8Decoder utf8_decoder;
+    ThroughputMode throughput_mode;
+    std::vector<char32_t> decoded;
+    PaneCache pane_cache;
+    ImageCache image_cache{wake_event_loop};
+    FrameCapture frame_capture;
+    LinkDetector link_detector{wake_event_loop};
+    // Null until a shell was started.
+    std::unique_ptr<PtyReader> pty;
+
+    bool shaders_warm = false;
+
+    // Hash of the inputs of the frame currently on screen.
+    uint64_t last_frame_hash = 0;
+    bool presented = false;
+
+    RendererStats frame_stats = {};
 };
 
+std::unique_ptr<FontLoader>& preloaded_fonts() {
+    static std::unique_ptr<FontLoader> loader;
+    return loader;
+}
+
+Renderer& shared_renderer() {
+    static Renderer renderer;
+    return renderer;
+}
+
 void cgl_context() {
     CGLPixelFormatAttribute attribs[] = {
         kCGLPFAColorSize,
@@ -47,13 +223,132 @@ void cgl_context() {
     CGLSetCurrentContext(context);
 }
 
-void draw() {
-    NSView* view = [[NSView alloc] init];
+void preload_fonts(float scale_factor) {
+    if (preloaded_fonts()) return;
+    preloaded_fonts() = std::make_unique<FontLoader>(kFontFamily, kFontPoints * scale_factor);
+}
 
-    GLuint vao = 0;
-    GLuint ebo = 0;
-    GLuint vbo_instance = 0;
-    GLuint tex_id = 0;
+bool draw() {
+    return shared_renderer().draw();
+}
+
+void resize(uint32_t width, uint32_t height) {
+    shared_renderer().resize(width, height);
+}
+
+void prewarm_shaders() {
+    shared_renderer().warm_up_shaders();
+}
+
+uint64_t next_frame_delay_us() {
+    return shared_renderer().frame_delay_us();
+}
+
+void context_lost() {
+    shared_renderer().context_lost();
+}
+
+RendererStats renderer_stats() {
+    return shared_renderer().stats();
+}
+
+void submit_image(uint32_t id, const uint8_t* data, size_t size) {
+    shared_renderer().submit_image(id, std::vector<uint8_t>(data, data + size));
+}
+
+void place_image(uint32_t id, uint16_t col, uint16_t row, uint16_t columns, uint16_t rows) {
+    shared_renderer().place_image(ImagePlacement{id, col, row, columns, rows});
+}
+
+void write_text(const uint8_t* data, size_t size) {
+    shared_renderer().write_text(data, size);
+}
+
+bool start_shell() {
+    return shared_renderer().start_shell();
+}
+
+bool process_output() {
+    return shared_renderer().process_output();
+}
+
+void start_capture(CaptureFormat format, const char* path_prefix, FrameCallback callback,
+                   void* data, uint32_t frame_count) {
+    shared_renderer().start_capture(format, path_prefix ? path_prefix : "frame", callback, data,
+                                    frame_count);
+}
+
+void stop_capture() {
+    shared_renderer().stop_capture();
+}
+
+Renderer::Renderer() : context(CGLGetCurrentContext()) {
+    // Every program is compiling from here on, overlapping with waiting for the fonts below.
+    setup_gl();
+    record_startup_phase("main", "shaders submitted");
+
+    // Fonts are only loaded here when nothing preloaded them, in which case nothing overlaps.
+    if (!preloaded_fonts()) preload_fonts(1.0);
+    std::unique_ptr<FontLoader> loader = std::move(preloaded_fonts());
+    auto wait_start = std::chrono::steady_clock::now();
+    loader->wait();
+    frame_stats.font_wait_us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - wait_start)
+                                            .count());
+    record_startup_phase("main", "fonts joined");
+
+    rasterizer = loader->take_rasterizer();
+    CellMetrics metrics = loader->cell_metrics();
+    cell_width = metrics.width;
+    cell_height = metrics.height;
+    baseline = metrics.baseline;
+    uploader = GlyphUploader::create(context);
+    for (LoadedGlyph& glyph : loader->ascii_glyphs()) {
+        glyph_cache.insert(glyph.codepoint, glyph.bitmap, uploader.get());
+    }
+    record_startup_phase("main", "ascii uploaded");
+
+    std::vector<uint8_t> solid(size_t(cell_width) * kUnderlineThickness * 3, 255);
+    underline_glyph = glyph_cache.insert_pinned(
+        RasterizedGlyph{0, kUnderlineTop, int16_t(cell_width), kUnderlineThickness, solid.data()},
+        uploader.get());
+    // Decorations are not collected with the instances, so the first frame waits for everything
+    // uploaded up to here.
+    if (uploader) frame_upload = uploader->last_ticket();
+
+    emoji_font = CTFontCreateWithName(CFSTR("AppleColorEmoji"), cell_height, nullptr);
+    if (emoji_font) {
+        CFDataRef sbix = CTFontCopyTable(emoji_font, kCTFontTableSbix, kCTFontTableOptionNoOptions);
+        if (sbix) {
+            emoji_cache = std::make_unique<EmojiCache>(sbix, CTFontGetGlyphCount(emoji_font),
+                                                       wake_event_loop);
+            CFRelease(sbix);
+        }
+    }
+
+    // The default viewport covers the whole drawable of the surface the context was made current
+    // with.
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    window_width = viewport[2];
+    window_height = viewport[3];
+
+    Pane pane{};
+    pane.x = kPadding;
+    pane.y = kPadding;
+    pane.width = std::max<GLsizei>(window_width - 2 * kPadding, 1);
+    pane.height = std::max<GLsizei>(window_height - 2 * kPadding, 1);
+    resize_grid(pane);
+    panes.push_back(std::move(pane));
+
+    link_programs();
+    record_startup_phase("main", "programs linked");
+
+    std::cout << glGetString(GL_VERSION) << '\n';
+}
+
+void Renderer::setup_gl() {
+    setup_parallel_compile();
 
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC1_COLOR, GL_ONE_MINUS_SRC1_COLOR);
@@ -69,138 +364,614 @@ void draw() {
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, 6 * 4, indices, GL_STATIC_DRAW);
 
     glBindBuffer(GL_ARRAY_BUFFER, vbo_instance);
-    glBufferData(GL_ARRAY_BUFFER, 4096 * 28, nullptr, GL_STREAM_DRAW);
-
-    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_FALSE, 28, (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribDivisor(0, 1);
+    instance_capacity = kMaxInstances;
+    glBufferData(GL_ARRAY_BUFFER, instance_capacity * sizeof(InstanceData), nullptr,
+                 GL_STREAM_DRAW);
 
-    glVertexAttribPointer(1, 4, GL_SHORT, GL_FALSE, 28, (void*)4);
-    glEnableVertexAttribArray(1);
-    glVertexAttribDivisor(1, 1);
-
-    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, 28, (void*)12);
-    glEnableVertexAttribArray(2);
-    glVertexAttribDivisor(2, 1);
+    point_instance_attributes(0);
+    for (GLuint index = 0; index < 3; index++) {
+        glEnableVertexAttribArray(index);
+        glVertexAttribDivisor(index, 1);
+    }
 
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glGenTextures(1, &tex_id);
-    glBindTexture(GL_TEXTURE_2D, tex_id);
+    GLint major = 0;
+    GLint minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    draw_base_instance = nullptr;
+    if (major > 4 || (major == 4 && minor >= 2)) {
+        draw_base_instance = reinterpret_cast<DrawElementsInstancedBaseInstanceFn>(
+            dlsym(RTLD_DEFAULT, "glDrawElementsInstancedBaseInstance"));
+    }
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1024, 1024, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    pending_programs[kTextVariant] = setup_shaders(kTextVariant);
+    pending_programs[kColorVariant] = setup_shaders(kColorVariant);
+}
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// Wide pictographs are drawn from the color emoji font, everything else as text. So are the
+// pictographs the emoji font has no bitmap for.
+bool Renderer::cell_glyph(char32_t c, Glyph* out, ShaderVariant* variant) {
+    if (emoji_cache && char_width(c) == 2 && is_extended_pictographic(c)) {
+        bool missing = false;
+        if (color_glyph(c, out, &missing)) {
+            *variant = kColorVariant;
+            return true;
+        }
+        if (!missing) return false;
+    }
+    *variant = kTextVariant;
+    return text_glyph(c, out);
+}
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+// Rasterizes `c` on first use, from the first installed face that has it, or as the primary
+// font's .notdef when none does.
+bool Renderer::text_glyph(char32_t c, Glyph* out) {
+    if (glyph_cache.find(c, out)) return true;
+
+    const Rasterizer* source = rasterizer.get();
+    uint32_t glyph_index = source->glyph_index(c);
+    if (glyph_index == 0) {
+        if (const Rasterizer* fallback = fallback_rasterizer(c)) {
+            source = fallback;
+            glyph_index = fallback->glyph_index(c);
+        }
+    }
+
+    // Other processes may use another primary font and so another baseline; shared bitmaps are
+    // placed relative to the glyph's own.
+    RasterizedGlyph bitmap{0, 0, 0, 0, nullptr};
+    GlyphKey key = source->key(glyph_index);
+    SharedGlyphCache* shared_cache = SharedGlyphCache::open_default();
+    if (!shared_cache || !shared_cache->lookup(key, &bitmap)) {
+        bitmap = source->rasterize(glyph_index, &glyph_pixels);
+        if (shared_cache && bitmap.buffer) shared_cache->insert(key, bitmap);
+    }
+    if (bitmap.buffer) bitmap.top = int16_t(bitmap.top + baseline);
 
-    GLuint shader_program = setup_shaders();
+    *out = glyph_cache.insert(c, bitmap, uploader.get());
+    return true;
+}
+
+const Rasterizer* Renderer::fallback_rasterizer(char32_t c) {
+    const FontIndex* index = FontIndex::open_default();
+    std::shared_ptr<const FontFile> font = index ? index->fallback(c) : nullptr;
+    if (!font) return nullptr;
 
-    GLint u_projection = glGetUniformLocation(shader_program, "projection");
-    GLint u_cell_dim = glGetUniformLocation(shader_program, "cellDim");
+    std::unique_ptr<Rasterizer>& fallback = fallback_rasterizers[font->hash()];
+    if (!fallback) fallback = std::make_unique<Rasterizer>(font, rasterizer->pixel_size());
+    return fallback.get();
+}
+
+// Returns the atlas entry of emoji `c`, or false while its bitmap is still being decoded. Sets
+// `missing` as well when the emoji font has no bitmap for it.
+bool Renderer::color_glyph(char32_t c, Glyph* out, bool* missing) {
+    if (glyph_cache.find(c | kColorGlyphKey, out)) return true;
+
+    UniChar units[2];
+    CFIndex count = 1;
+    if (c >= 0x10000) {
+        units[0] = UniChar(0xD800 + ((c - 0x10000) >> 10));
+        units[1] = UniChar(0xDC00 + ((c - 0x10000) & 0x3FF));
+        count = 2;
+    } else {
+        units[0] = UniChar(c);
+    }
+    CGGlyph glyphs[2] = {};
+    if (!CTFontGetGlyphsForCharacters(emoji_font, units, glyphs, count)) {
+        *missing = true;
+        return false;
+    }
+
+    const ColorBitmap* bitmap = emoji_cache->get(glyphs[0], uint16_t(cell_height));
+    if (!bitmap) {
+        *missing = emoji_cache->missing(glyphs[0], uint16_t(cell_height));
+        return false;
+    }
+
+    // Bitmap tops are relative to the baseline, like the rasterizer's before it offsets them.
+    int16_t top = int16_t(baseline + bitmap->top);
+    *out = glyph_cache.insert(c | kColorGlyphKey,
+                              RasterizedGlyph{bitmap->left, top, bitmap->width, bitmap->height,
+                                              bitmap->pixels.data(), true},
+                              uploader.get());
+    return true;
+}
 
-    glViewport(10, 10, 3436, 2082);
-    glUseProgram(shader_program);
-    glUniform4f(u_projection, -1.0, 1.0, 0.0005820722, -0.00096061477);
-    glUniform2f(u_cell_dim, 20.0, 40.0);
+void Renderer::point_instance_attributes(size_t first) {
+    const char* base = reinterpret_cast<const char*>(first * sizeof(InstanceData));
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(InstanceData),
+                          base + offsetof(InstanceData, col));
+    glVertexAttribPointer(1, 4, GL_SHORT, GL_FALSE, sizeof(InstanceData),
+                          base + offsetof(InstanceData, left));
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                          base + offsetof(InstanceData, uv_left));
+}
+
+void Renderer::link_programs() {
+    for (int variant = 0; variant < kVariantCount; variant++) {
+        GLuint program = finish_program(pending_programs[variant]);
+        glyph_programs[variant] = program;
+        u_projection[variant] = glGetUniformLocation(program, "projection");
+
+        glUseProgram(program);
+        glUniform2f(glGetUniformLocation(program, "cellDim"), cell_width, cell_height);
+    }
     glUseProgram(0);
 
-    glUseProgram(shader_program);
+    pane_cache.link();
+    image_cache.link();
+}
+
+void Renderer::recover_context() {
+    // Objects of the old context are gone with it, so they are recreated rather than deleted.
+    // Uploads still queued are covered by the restored pages, so the new uploader treats their
+    // tickets as finished.
+    if (uploader) {
+        uint64_t last_ticket = uploader->last_ticket();
+        uploader.reset();
+        uploader = GlyphUploader::create(context, last_ticket);
+    }
+    setup_gl();
+    pane_cache.context_lost();
+    image_cache.context_lost();
+    frame_capture.context_lost();
+    reclaimer.context_lost();
+    glyph_cache.restore();
+    // Later glyphs are uploaded into the restored pages from the upload context.
+    if (uploader) glFlush();
+    link_programs();
+
+    presented = false;
+    frame_stats.context_recoveries++;
+
+    // The new context compiles its programs from scratch.
+    shaders_warm = false;
+    warm_up_shaders();
+}
+
+void Renderer::context_lost() {
+    context = CGLGetCurrentContext();
+    recover_context();
+}
+
+RendererStats Renderer::stats() const {
+    // Walking the shadows is only worth it when someone asks.
+    RendererStats stats = frame_stats;
+    stats.atlas_shadow_bytes = glyph_cache.shadow_size();
+    stats.atlas_raw_bytes = glyph_cache.raw_size();
+    return stats;
+}
+
+void Renderer::warm_up_shaders() {
+    if (shaders_warm) return;
+    shaders_warm = true;
+
+    GLuint fbo = 0;
+    GLuint texture = 0;
+    glGenFramebuffers(1, &fbo);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glViewport(0, 0, 1, 1);
+
+    auto warmup_start = std::chrono::steady_clock::now();
+    const GLfloat projection[4] = {-1.0, 1.0, 2.0, -2.0};
+    InstanceData text = {};
+    InstanceData color = {};
+    color.variant = kColorVariant;
+    draw_instances({text, color}, projection);
+    pane_cache.warm_up();
+    image_cache.warm_up();
+    // Finishing first counts the driver's compile time, not just the submission.
+    glFinish();
+    frame_stats.shader_warmup_us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                                std::chrono::steady_clock::now() - warmup_start)
+                                                .count());
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+}
+
+bool Renderer::draw() {
+    // A context made current without `context_lost` still gets its objects rebuilt.
+    CGLContextObj current = CGLGetCurrentContext();
+    if (current != context) {
+        context = current;
+        recover_context();
+    }
+    reclaimer.pin();
+
+    // Redraw requests keep coming while readbacks are in flight, so they are all delivered even
+    // when nothing else changes.
+    if (frame_capture.poll()) wake_event_loop();
+
+    // Damage added by collecting links is not scanned again, since it only changes decorations.
+    for (size_t i = 0; i < panes.size(); i++) {
+        frame_stats.link_rows_scanned += link_detector.scan(i, panes[i].grid, panes[i].damage);
+    }
+    link_detector.collect(panes);
+
+    // Emoji that finished decoding replace the blanks drawn while they were pending.
+    if (emoji_cache && emoji_cache->collect()) {
+        for (Pane& pane : panes) {
+            for (uint16_t row = 0; row < pane.grid.rows.size(); row++) pane.damage.push_back(row);
+        }
+    }
+
+    // Panes that are only composited don't draw their images, but they still show them.
+    for (const Pane& pane : panes) image_cache.mark_used(pane.images);
+    if (image_cache.upload()) {
+        for (Pane& pane : panes) {
+            for (const ImagePlacement& placement : pane.images) {
+                pane.damage.push_back(uint16_t(std::max(placement.row, 0)));
+            }
+        }
+    }
+
+    uint64_t evictions = glyph_cache.evictions();
+    for (Pane& pane : panes) {
+        if (!pane.damage.empty()) build_instances(pane);
+    }
+    glyph_cache.publish();
+    // Instances built by earlier frames may point into an evicted page. Those built by this one
+    // cannot, since pages read by the frame being built are never evicted.
+    if (glyph_cache.evictions() != evictions) {
+        for (Pane& pane : panes) {
+            if (!pane.damage.empty()) continue;
+            for (uint16_t row = 0; row < pane.grid.rows.size(); row++) pane.damage.push_back(row);
+            build_instances(pane);
+        }
+        glyph_cache.publish();
+    }
+
+    uint64_t frame_hash = hash_frame();
+    if (presented && frame_hash == last_frame_hash) {
+        // Damage that reproduced identical instances leaves the cached pane output valid.
+        for (Pane& pane : panes) pane.damage.clear();
+        frame_stats.frames_skipped++;
+        reclaimer.unpin();
+        return false;
+    }
+
+    // Only uploads of glyphs this frame draws hold it up, and only on the GPU.
+    if (uploader && frame_upload) {
+        uploader->wait(frame_upload);
+        frame_upload = 0;
+    }
+
+    glClearColor(1.0, 1.0, 1.0, 1.0);
+
+    for (size_t i = 0; i < panes.size(); i++) {
+        Pane& pane = panes[i];
+        if (!pane_cache.begin(i, pane)) continue;
+        frame_stats.panes_rendered++;
+
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        GLfloat projection[4] = {-1.0, 1.0, 2.0f / pane.width, -2.0f / pane.height};
+        draw_instances(pane.instances, projection);
+
+        build_decorations(pane);
+        draw_instances(decorations, projection);
+
+        image_cache.draw(pane.images, projection, cell_width, cell_height);
+
+        pane.damage.clear();
+    }
+
+    pane_cache.composite(panes, window_width, window_height);
+    frame_stats.panes_composited += panes.size();
+
+    frame_capture.capture(frame_stats.frames_drawn, window_width, window_height);
+    reclaimer.unpin();
+    glFlush();
+
+    last_frame_hash = frame_hash;
+    presented = true;
+    throughput_mode.frame_drawn();
+    frame_stats.frames_drawn++;
+    frame_stats.image_tiles_uploaded = image_cache.tiles_uploaded();
+    frame_stats.image_evictions = image_cache.evictions();
+    frame_stats.frames_captured = frame_capture.captured();
+    frame_stats.captures_dropped = frame_capture.dropped();
+    if (emoji_cache) frame_stats.emoji_decoded = emoji_cache->decoded();
+    frame_stats.atlas_evictions = glyph_cache.evictions();
+    frame_stats.reclaim_waits = reclaimer.waits();
+    frame_stats.glyph_snapshots = glyph_cache.snapshots_published();
+    frame_stats.row_cache_hits = row_cache.hits();
+    frame_stats.row_cache_misses = row_cache.misses();
+    frame_stats.row_cache_bytes = row_cache.size();
+    frame_stats.throughput_switches = throughput_mode.switches();
+    frame_stats.frames_deferred = throughput_mode.deferred_frames();
+    if (pty) {
+        frame_stats.pty_bytes_read = pty->bytes_read();
+        frame_stats.pty_reads = pty->reads();
+        frame_stats.pty_backpressure_waits = pty->stalls();
+    }
+    if (uploader) {
+        frame_stats.glyphs_uploaded_async = uploader->uploads();
+        frame_stats.upload_stalls = uploader->stalls();
+        frame_stats.upload_stall_us = uploader->stall_us();
+    }
+
+    if (frame_stats.frames_drawn == 1) {
+        record_startup_phase("main", "first frame");
+        frame_stats.startup_us = startup_elapsed_us();
+        print_startup_timeline();
+    }
+    return true;
+}
+
+void Renderer::resize(GLsizei width, GLsizei height) {
+    if (width == window_width && height == window_height) return;
+
+    window_width = width;
+    window_height = height;
+
+    // The grid pane tracks the window size, keeping a texture to render into even when the padding
+    // takes up the whole window.
+    Pane& pane = panes.front();
+    pane.width = std::max<GLsizei>(window_width - 2 * kPadding, 1);
+    pane.height = std::max<GLsizei>(window_height - 2 * kPadding, 1);
+    resize_grid(pane);
+    if (pty) pty->resize(pane.grid.columns, uint16_t(pane.grid.rows.size()));
+}
+
+void Renderer::resize_grid(Pane& pane) {
+    pane.grid.resize(uint16_t(std::max(pane.width, 0) / cell_width),
+                     uint16_t(std::max(pane.height, 0) / cell_height));
+
+    pane.damage.clear();
+    for (uint16_t row = 0; row < pane.grid.rows.size(); row++) pane.damage.push_back(row);
+}
+
+// Emits one instance per cell with ink from the pane's grid. Cells have no background of their own,
+// so blank ones draw nothing and are skipped.
+//
+// Rows whose contents were built before against the same atlas placements are copied from the
+// row cache instead.
+void Renderer::build_instances(Pane& pane) {
+    pane.instances.clear();
+    uint64_t generation = glyph_cache.evictions();
+    for (size_t row = 0; row < pane.grid.rows.size(); row++) {
+        const std::vector<Cell>& cells = pane.grid.rows[row].cells;
+        uint64_t row_hash = hash_bytes(cells.data(), cells.size() * sizeof(Cell), generation);
+        size_t first = pane.instances.size();
+
+        uint64_t row_upload = 0;
+        if (const std::vector<InstanceData>* cached = row_cache.find(row_hash, &row_upload)) {
+            pane.instances.insert(pane.instances.end(), cached->begin(), cached->end());
+            // Lookups would have kept the pages from being evicted under this frame.
+            int marked_page = -1;
+            for (size_t i = first; i < pane.instances.size(); i++) {
+                pane.instances[i].row = uint16_t(row);
+                if (pane.instances[i].atlas_page != marked_page) {
+                    marked_page = pane.instances[i].atlas_page;
+                    glyph_cache.mark_page_used(uint16_t(marked_page));
+                }
+            }
+            frame_upload = std::max(frame_upload, row_upload);
+            continue;
+        }
+
+        // Rows waiting for an emoji to decode are built again once it has.
+        bool complete = true;
+        frame_stats.cells_built += cells.size();
+        for (size_t col = 0; col < cells.size(); col++) {
+            // The cell after a wide character only holds a spacer.
+            if (cells[col].codepoint == 0) continue;
+            if (cells[col].codepoint == U' ') {
+                frame_stats.blank_cells_elided++;
+                continue;
+            }
+
+            Glyph glyph;
+            ShaderVariant variant;
+            if (!cell_glyph(cells[col].codepoint, &glyph, &variant)) {
+                complete = false;
+                continue;
+            }
+            // Other characters without ink, such as no-break spaces.
+            if (glyph.width == 0) {
+                frame_stats.blank_cells_elided++;
+                continue;
+            }
+
+            row_upload = std::max(row_upload, glyph.upload);
+            pane.instances.push_back(InstanceData{
+                uint16_t(col), uint16_t(row), glyph.left, glyph.top, glyph.width, glyph.height,
+                glyph.uv_left, glyph.uv_bot, glyph.uv_width, glyph.uv_height, glyph.page,
+                variant});
+        }
+
+        frame_upload = std::max(frame_upload, row_upload);
+        if (complete) {
+            row_cache.insert(row_hash, pane.instances.data() + first,
+                             pane.instances.size() - first, row_upload);
+        }
+    }
+}
+
+void Renderer::build_decorations(const Pane& pane) {
+    decorations.clear();
+    for (size_t row = 0; row < pane.grid.rows.size(); row++) {
+        for (const LinkSpan& link : pane.grid.rows[row].links) {
+            for (uint16_t col = link.start; col < link.end; col++) {
+                decorations.push_back(InstanceData{
+                    col, uint16_t(row), underline_glyph.left, underline_glyph.top,
+                    underline_glyph.width, underline_glyph.height, underline_glyph.uv_left,
+                    underline_glyph.uv_bot, underline_glyph.uv_width, underline_glyph.uv_height,
+                    underline_glyph.page, kTextVariant});
+            }
+        }
+    }
+}
+
+void Renderer::submit_image(uint32_t id, std::vector<uint8_t> data) {
+    image_cache.submit(id, std::move(data));
+}
+
+void Renderer::place_image(const ImagePlacement& placement) {
+    Pane& pane = panes.front();
+    // An image placed at a cell replaces the one there before.
+    pane.images.erase(std::remove_if(pane.images.begin(), pane.images.end(),
+                                     [&](const ImagePlacement& other) {
+                                         return other.col == placement.col &&
+                                                other.row == placement.row;
+                                     }),
+                      pane.images.end());
+    pane.images.push_back(placement);
+    pane.damage.push_back(uint16_t(std::max(placement.row, 0)));
+}
+
+// Moves placements up with the rows they were placed on, dropping those that scrolled out.
+void Renderer::scroll_images(Pane& pane, uint64_t count) {
+    // No image is anywhere near this many rows tall, so a longer scroll drops them all.
+    int32_t shift = int32_t(std::min<uint64_t>(count, kMaxImageScroll));
+    for (ImagePlacement& placement : pane.images) placement.row -= shift;
+
+    auto scrolled_out = [this](const ImagePlacement& placement) {
+        return placement.row + int64_t(image_cache.rows_covered(placement, cell_height)) <= 0;
+    };
+    pane.images.erase(std::remove_if(pane.images.begin(), pane.images.end(), scrolled_out),
+                      pane.images.end());
+}
+
+void Renderer::write_text(const uint8_t* data, size_t size) {
+    throughput_mode.record_input(size);
+    decoded.clear();
+    utf8_decoder.decode(data, size, &decoded);
+
+    Pane& pane = panes.front();
+    uint64_t scrolled = pane.grid.scrolled_rows;
+    pane.grid.write(decoded.data(), decoded.size(), &pane.damage);
+    if (pane.grid.scrolled_rows != scrolled) {
+        scroll_images(pane, pane.grid.scrolled_rows - scrolled);
+    }
+}
+
+bool Renderer::start_shell() {
+    if (pty) return true;
+
+    const char* shell = getenv("SHELL");
+    if (!shell || !*shell) shell = "/bin/zsh";
+    const Pane& pane = panes.front();
+    pty = PtyReader::spawn(shell, pane.grid.columns, uint16_t(pane.grid.rows.size()),
+                           wake_event_loop);
+    return pty != nullptr;
+}
+
+bool Renderer::process_output() {
+    if (!pty) return true;
+    pty->consume(kOutputBudget,
+                 [this](const uint8_t* data, size_t size) { write_text(data, size); });
+    return !pty->exited();
+}
+
+void Renderer::start_capture(CaptureFormat format, std::string path_prefix,
+                             FrameCallback callback, void* callback_data, uint32_t frame_count) {
+    frame_capture.start(format, std::move(path_prefix), callback, callback_data, frame_count);
+
+    // An unchanged frame would not be drawn, and so never captured.
+    presented = false;
+    wake_event_loop();
+}
+
+void Renderer::stop_capture() {
+    frame_capture.stop();
+    frame_stats.frames_captured = frame_capture.captured();
+    frame_stats.captures_dropped = frame_capture.dropped();
+}
+
+uint64_t Renderer::hash_frame() {
+    uint64_t h = hash_combine(window_width, window_height);
+    h = hash_combine(h, image_cache.generation());
+    // Evicted atlas pages are refilled with other glyphs, so instances that did not change may
+    // still sample different texels.
+    h = hash_combine(h, glyph_cache.evictions());
+    h = hash_combine(h, hash_bytes(&cell_width, sizeof(cell_width)));
+    h = hash_combine(h, hash_bytes(&cell_height, sizeof(cell_height)));
+
+    for (Pane& pane : panes) {
+        // Only damaged panes can have changed instances.
+        if (!pane.damage.empty()) {
+            pane.content_hash =
+                hash_bytes(pane.instances.data(), pane.instances.size() * sizeof(InstanceData));
+            pane.content_hash = hash_bytes(pane.images.data(),
+                                           pane.images.size() * sizeof(ImagePlacement),
+                                           pane.content_hash);
+            for (const Row& row : pane.grid.rows) {
+                pane.content_hash = hash_bytes(row.links.data(),
+                                               row.links.size() * sizeof(LinkSpan),
+                                               pane.content_hash);
+            }
+        }
+
+        h = hash_combine(h, (uint64_t(uint32_t(pane.x)) << 32) | uint32_t(pane.y));
+        h = hash_combine(h, (uint64_t(uint32_t(pane.width)) << 32) | uint32_t(pane.height));
+        h = hash_combine(h, pane.content_hash);
+    }
+    return h;
+}
+
+void Renderer::draw_instances(const std::vector<InstanceData>& instances,
+                              const GLfloat projection[4]) {
+    sort_instances(instances, glyph_cache.page_count(), &sorted_instances, &draw_buckets);
+
     glBindVertexArray(vao);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
     glBindBuffer(GL_ARRAY_BUFFER, vbo_instance);
     glActiveTexture(GL_TEXTURE0);
 
-    std::vector<uint8_t> buffer = {
-        77,  77,  77,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,
-        84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,  84,
-        84,  84,  84,  77,  77,  77,  0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 235, 235, 235, 0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 235, 235, 235, 0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        124, 124, 124, 83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  83,
-        83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  83,  77,  77,  77,  0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 59,  59,  59,  0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        59,  59,  59,  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 59,  59,  59,  0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        59,  59,  59,  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 59,  59,  59,  0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        136, 136, 136, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-        100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 45,  45,  45,  0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 115, 115, 115, 0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 115, 115, 115, 0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 112, 112, 112, 67,  67,  67,  67,  67,  67,
-        67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,  67,
-        67,  67,  67,  30,  30,  30,  0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        59,  59,  59,  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 59,  59,  59,  0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        59,  59,  59,  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 59,  59,  59,  0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        59,  59,  59,  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 59,  59,  59,  0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        59,  59,  59,  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 59,  59,  59,  0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
-        0,   0,   0,   0,   0,   0,   0,   0,   0,   235, 235, 235, 255, 255, 255, 255, 255, 255,
-        188, 188, 188, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168,
-        168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 168, 36,  36,  36,
-        235, 235, 235, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 55,  55,  55,  235, 235, 235, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 55,  55,  55};
-
-    glBindTexture(GL_TEXTURE_2D, tex_id);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 15, 24, GL_RGB, GL_UNSIGNED_BYTE, buffer.data());
-    glBindTexture(GL_TEXTURE_2D, 0);
+    // Every bucket draws out of a single upload.
+    if (sorted_instances.size() > instance_capacity) {
+        instance_capacity = std::max(sorted_instances.size(), instance_capacity * 2);
+        glBufferData(GL_ARRAY_BUFFER, instance_capacity * sizeof(InstanceData), nullptr,
+                     GL_STREAM_DRAW);
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sorted_instances.size() * sizeof(InstanceData),
+                    sorted_instances.data());
 
-    std::vector<InstanceData> instances;
-    instances.push_back(InstanceData{20, 20, 24, 3, 15, 24, 0.0, 0.0, 0.0146484375, 0.0234375});
+    int bound_variant = -1;
+    int bound_page = -1;
+    for (const DrawBucket& bucket : draw_buckets) {
+        if (bucket.variant != bound_variant) {
+            bound_variant = bucket.variant;
+            glUseProgram(glyph_programs[bound_variant]);
+            glUniform4fv(u_projection[bound_variant], 1, projection);
+        }
+        if (bucket.atlas_page != bound_page) {
+            bound_page = bucket.atlas_page;
+            glBindTexture(GL_TEXTURE_2D, glyph_cache.texture(uint16_t(bound_page)));
+        }
 
-    glBufferSubData(GL_ARRAY_BUFFER, 0, 28, instances.data());
-    glBindTexture(GL_TEXTURE_2D, tex_id);
-    glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr, 1);
+        if (draw_base_instance) {
+            draw_base_instance(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr, bucket.count,
+                               bucket.first);
+        } else {
+            point_instance_attributes(bucket.first);
+            glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr, bucket.count);
+        }
+    }
+    if (!draw_base_instance) point_instance_attributes(0);
 
-    std::cout << glGetString(GL_VERSION) << '\n';
-
-    glFlush();
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
 }
 
-GLuint setup_shaders() {
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+PendingProgram setup_shaders(ShaderVariant variant) {
     const GLchar* vertSource = R"(
-    #version 330 core
-
 // Cell properties.
 layout(location = 0) in vec2 gridCoords;
 
@@ -241,8 +1012,6 @@ void main() {
 }
 )";
     const GLchar* fragSource = R"(
-    #version 330 core
-
 in vec2 TexCoords;
 
 layout(location = 0, index = 0) out vec4 color;
@@ -251,22 +1020,24 @@ layout(location = 0, index = 1) out vec4 alphaMask;
 uniform sampler2D mask;
 
 void main() {
+#ifdef COLORED
+    // Undo the premultiplication, since the blend multiplies by the mask again.
+    vec4 glyphColor = texture(mask, TexCoords);
+    alphaMask = vec4(glyphColor.a);
+    color = vec4(glyphColor.rgb / max(glyphColor.a, 1.0 / 255.0), 1.0);
+#else
     vec3 textColor = texture(mask, TexCoords).rgb;
     alphaMask = vec4(textColor, textColor.r);
     color = vec4(51 / 255.0, 51 / 255.0, 51 / 255.0, 1.0);
+#endif
 }
 )";
-    glShaderSource(vertexShader, 1, &vertSource, nullptr);
-    glShaderSource(fragmentShader, 1, &fragSource, nullptr);
-    glCompileShader(vertexShader);
-    glCompileShader(fragmentShader);
-
-    GLuint shader_program = glCreateProgram();
-    glAttachShader(shader_program, vertexShader);
-    glAttachShader(shader_program, fragmentShader);
-    glLinkProgram(shader_program);
-
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    return shader_program;
+
+    // Variants share their sources and differ only in defines, which have to follow the version.
+    std::string header = "#version 330 core\n";
+    if (variant == kColorVariant) header += "#define COLORED\n";
+    std::string vert = header + vertSource;
+    std::string frag = header + fragSource;
+    return begin_program(variant == kColorVariant ? "color glyph" : "glyph", vert.c_str(),
+                         frag.c_str());
 }
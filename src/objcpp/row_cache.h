@@ -0,0 +1,61 @@
+#pragma once
+
+#include "instance_data.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Instances of recently built grid rows, by a hash of the row's contents and the atlas generation
+// they were built against.
+//
+// Rows that scroll back into view, or that a full-screen program repaints unchanged, are copied
+// from here instead of looking every cell's glyph up again. Entries are stored with row 0, so the
+// caller only patches the row of each copied instance. The least recently used entries are dropped
+// to stay within the memory budget.
+class RowCache {
+public:
+    explicit RowCache(size_t max_bytes);
+
+    RowCache(const RowCache&) = delete;
+    RowCache& operator=(const RowCache&) = delete;
+
+    // Returns the instances cached for `hash`, valid until the next `insert`, and the newest
+    // upload ticket among their glyphs. Null on a miss.
+    const std::vector<InstanceData>* find(uint64_t hash, uint64_t* upload);
+
+    void insert(uint64_t hash, const InstanceData* instances, size_t count, uint64_t upload);
+
+    uint64_t hits() const {
+        return hit_count;
+    }
+
+    uint64_t misses() const {
+        return miss_count;
+    }
+
+    // Bytes held, counting an estimate of each entry's bookkeeping.
+    size_t size() const {
+        return bytes;
+    }
+
+private:
+    struct Entry {
+        std::vector<InstanceData> instances;
+        uint64_t upload;
+        std::list<uint64_t>::iterator recency;
+    };
+
+    void erase(std::unordered_map<uint64_t, Entry>::iterator it);
+
+    size_t max_bytes;
+    size_t bytes = 0;
+
+    std::unordered_map<uint64_t, Entry> entries;
+    // Hashes of the entries, most recently used first.
+    std::list<uint64_t> recency;
+
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+};
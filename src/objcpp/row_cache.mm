@@ -0,0 +1,52 @@
+#import "row_cache.h"
+
+namespace {
+
+// Map node, recency node and vector header of an entry, roughly; charged so that rows without
+// instances still count against the budget.
+constexpr size_t kEntryOverhead = 96;
+
+size_t entry_size(size_t count) {
+    return count * sizeof(InstanceData) + kEntryOverhead;
+}
+
+}
+
+RowCache::RowCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+const std::vector<InstanceData>* RowCache::find(uint64_t hash, uint64_t* upload) {
+    auto it = entries.find(hash);
+    if (it == entries.end()) {
+        miss_count++;
+        return nullptr;
+    }
+
+    hit_count++;
+    recency.splice(recency.begin(), recency, it->second.recency);
+    *upload = it->second.upload;
+    return &it->second.instances;
+}
+
+void RowCache::insert(uint64_t hash, const InstanceData* instances, size_t count,
+                      uint64_t upload) {
+    size_t entry_bytes = entry_size(count);
+    if (entry_bytes > max_bytes) return;
+
+    auto existing = entries.find(hash);
+    if (existing != entries.end()) erase(existing);
+    while (bytes + entry_bytes > max_bytes) erase(entries.find(recency.back()));
+
+    recency.push_front(hash);
+    Entry& entry = entries[hash];
+    entry.instances.assign(instances, instances + count);
+    for (InstanceData& instance : entry.instances) instance.row = 0;
+    entry.upload = upload;
+    entry.recency = recency.begin();
+    bytes += entry_bytes;
+}
+
+void RowCache::erase(std::unordered_map<uint64_t, Entry>::iterator it) {
+    bytes -= entry_size(it->second.instances.size());
+    recency.erase(it->second.recency);
+    entries.erase(it);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <OpenGL/gl3.h>
+
+// A program whose shaders were handed to the driver but not necessarily compiled and linked yet.
+//
+// With KHR_parallel_shader_compile the driver compiles on its own threads and `program_ready` can
+// be polled without blocking. Without it `program_ready` always returns true and
+// `finish_program` blocks until compilation is done, which is the old synchronous behavior.
+struct PendingProgram {
+    const char* name;
+    GLuint program;
+    GLuint vertex;
+    GLuint fragment;
+};
+
+// Looks the extension up in the current context and lets its driver use as many compiler threads
+// as it likes. Every context needs this once; `begin_program` does it for a context it has not
+// seen, and a context replacing one at the same address has to call it itself.
+void setup_parallel_compile();
+
+// Starts compiling and linking a program from vertex and fragment shader sources.
+PendingProgram begin_program(const char* name, const GLchar* vertSource,
+                             const GLchar* fragSource);
+
+bool program_ready(const PendingProgram& pending);
+
+// Waits for the program and returns it, or returns 0 after logging why it failed to compile or
+// link.
+GLuint finish_program(PendingProgram& pending);
@@ -0,0 +1,114 @@
+#import "shader.h"
+#import <OpenGL/OpenGL.h>
+#import <cstring>
+#import <dlfcn.h>
+#import <iostream>
+#import <string>
+#import <thread>
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+namespace {
+
+// Context the extension was last looked up in, and whether it has it.
+CGLContextObj configured_context = nullptr;
+bool parallel_compile = false;
+
+bool parallel_compile_supported() {
+    if (CGLGetCurrentContext() != configured_context) setup_parallel_compile();
+    return parallel_compile;
+}
+
+void log_shader_errors(const char* name, const char* stage, GLuint shader) {
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status == GL_TRUE) return;
+
+    GLint length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    std::string log(length > 0 ? length : 1, '\0');
+    glGetShaderInfoLog(shader, log.size(), nullptr, log.data());
+    std::cerr << "failed to compile " << name << " " << stage << " shader:\n" << log.c_str() << '\n';
+}
+
+}
+
+void setup_parallel_compile() {
+    configured_context = CGLGetCurrentContext();
+    parallel_compile = false;
+
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+        const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+        if (name && (strcmp(name, "GL_KHR_parallel_shader_compile") == 0 ||
+                     strcmp(name, "GL_ARB_parallel_shader_compile") == 0)) {
+            // Let the driver use as many compiler threads as it likes.
+            using MaxThreadsFn = void (*)(GLuint);
+            auto max_threads = reinterpret_cast<MaxThreadsFn>(
+                dlsym(RTLD_DEFAULT, "glMaxShaderCompilerThreadsKHR"));
+            if (max_threads) max_threads(0xFFFFFFFF);
+            parallel_compile = true;
+            return;
+        }
+    }
+}
+
+PendingProgram begin_program(const char* name, const GLchar* vertSource,
+                             const GLchar* fragSource) {
+    parallel_compile_supported();
+
+    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(vertexShader, 1, &vertSource, nullptr);
+    glShaderSource(fragmentShader, 1, &fragSource, nullptr);
+    glCompileShader(vertexShader);
+    glCompileShader(fragmentShader);
+
+    // Linking does not wait for compilation either; its status covers both.
+    GLuint shader_program = glCreateProgram();
+    glAttachShader(shader_program, vertexShader);
+    glAttachShader(shader_program, fragmentShader);
+    glLinkProgram(shader_program);
+
+    return PendingProgram{name, shader_program, vertexShader, fragmentShader};
+}
+
+bool program_ready(const PendingProgram& pending) {
+    if (!parallel_compile_supported()) return true;
+
+    GLint complete = GL_FALSE;
+    glGetProgramiv(pending.program, GL_COMPLETION_STATUS_KHR, &complete);
+    return complete == GL_TRUE;
+}
+
+GLuint finish_program(PendingProgram& pending) {
+    // Yield while the driver's compiler threads are busy instead of blocking inside the status
+    // query below.
+    while (!program_ready(pending)) std::this_thread::yield();
+
+    GLuint shader_program = pending.program;
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(shader_program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        log_shader_errors(pending.name, "vertex", pending.vertex);
+        log_shader_errors(pending.name, "fragment", pending.fragment);
+
+        GLint length = 0;
+        glGetProgramiv(shader_program, GL_INFO_LOG_LENGTH, &length);
+        std::string log(length > 0 ? length : 1, '\0');
+        glGetProgramInfoLog(shader_program, log.size(), nullptr, log.data());
+        std::cerr << "failed to link " << pending.name << " program:\n" << log.c_str() << '\n';
+
+        glDeleteProgram(shader_program);
+        shader_program = 0;
+    }
+
+    glDeleteShader(pending.vertex);
+    glDeleteShader(pending.fragment);
+    pending = PendingProgram{pending.name, 0, 0, 0};
+    return shader_program;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "glyph.h"
+#include <cstddef>
+#include <cstdint>
+
+// Rasterized glyph bitmaps shared between every process of the same user.
+//
+// The cache lives in a POSIX shared memory object so a freshly started process can copy bitmaps
+// other processes already rasterized straight into its atlas. The index is an open addressing hash
+// table whose slots are claimed with a CAS and published with a release store, so lookups and
+// inserts never take a lock. Bitmaps are bump allocated from an arena behind the index and are
+// never freed; once the arena is full further inserts are dropped.
+//
+// Glyph tops are relative to the baseline, since processes with different primary fonts place the
+// same glyph at different heights in their cells.
+class SharedGlyphCache {
+public:
+    // Returns the process wide cache, or `nullptr` when it is disabled or could not be mapped.
+    //
+    // The cache is opt-in through the `GLYPH_ATLAS_SHARED_CACHE=1` environment variable.
+    static SharedGlyphCache* open_default();
+
+    SharedGlyphCache(const SharedGlyphCache&) = delete;
+    SharedGlyphCache& operator=(const SharedGlyphCache&) = delete;
+    ~SharedGlyphCache();
+
+    bool lookup(const GlyphKey& key, RasterizedGlyph* glyph) const;
+    bool insert(const GlyphKey& key, const RasterizedGlyph& glyph);
+
+private:
+    struct Header;
+    struct Slot;
+
+    SharedGlyphCache(void* base, size_t size);
+
+    static size_t mapping_size();
+    static SharedGlyphCache* open(const char* name);
+    // Maps the object `name`, creating it when there is none. Sets `stale` when an existing object
+    // can never become usable, so it should be replaced.
+    static SharedGlyphCache* attach(const char* name, bool* stale);
+
+    Header* header() const;
+    Slot* slots() const;
+    uint8_t* arena() const;
+
+    void* base;
+    size_t size;
+};
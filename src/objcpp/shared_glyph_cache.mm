@@ -0,0 +1,242 @@
+#import "shared_glyph_cache.h"
+#import <atomic>
+#import <cerrno>
+#import <chrono>
+#import <cstdio>
+#import <cstdlib>
+#import <cstring>
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <thread>
+#import <unistd.h>
+
+namespace {
+
+constexpr uint32_t kMagic = 0x47414331;  // "GAC1"
+// 2: glyph tops are relative to the baseline.
+constexpr uint32_t kVersion = 2;
+constexpr uint32_t kSlotCount = 16384;
+constexpr uint32_t kMaxProbes = 64;
+constexpr uint64_t kArenaSize = 32 * 1024 * 1024;
+// Milliseconds to wait for another process to finish creating the object.
+constexpr int kInitWaits = 10;
+
+enum SlotState : uint32_t {
+    kSlotEmpty = 0,
+    kSlotWriting = 1,
+    kSlotReady = 2,
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+uint64_t hash_key(const GlyphKey& key) {
+    uint64_t h = key.font_hash;
+    h ^= (uint64_t(key.glyph_id) << 32) | key.size;
+    h ^= uint64_t(key.subpixel_bin) << 56;
+    // splitmix64 finalizer.
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+}
+
+}
+
+struct SharedGlyphCache::Header {
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t max_probes;
+    uint64_t arena_size;
+    std::atomic<uint64_t> arena_used;
+};
+
+struct SharedGlyphCache::Slot {
+    std::atomic<uint32_t> state;
+    uint32_t glyph_id;
+    uint64_t font_hash;
+    uint32_t size;
+    uint8_t subpixel_bin;
+
+    int16_t left;
+    int16_t top;
+    int16_t width;
+    int16_t height;
+
+    uint64_t offset;
+};
+
+SharedGlyphCache* SharedGlyphCache::open_default() {
+    static SharedGlyphCache* cache = [] {
+        const char* enabled = getenv("GLYPH_ATLAS_SHARED_CACHE");
+        if (!enabled || strcmp(enabled, "1") != 0) return static_cast<SharedGlyphCache*>(nullptr);
+
+        // Shared memory names are limited to 31 characters on macOS.
+        char name[32];
+        snprintf(name, sizeof(name), "/glyph-atlas.%u", getuid());
+        return open(name);
+    }();
+    return cache;
+}
+
+size_t SharedGlyphCache::mapping_size() {
+    return sizeof(Header) + kSlotCount * sizeof(Slot) + kArenaSize;
+}
+
+SharedGlyphCache* SharedGlyphCache::open(const char* name) {
+    // An object left behind by a creator that died before initializing it, or by a build with a
+    // different layout, is unlinked and replaced. Processes already mapping it keep their mapping.
+    bool stale = false;
+    SharedGlyphCache* cache = attach(name, &stale);
+    if (cache || !stale) return cache;
+    shm_unlink(name);
+    return attach(name, &stale);
+}
+
+SharedGlyphCache* SharedGlyphCache::attach(const char* name, bool* stale) {
+    size_t mapping_size = SharedGlyphCache::mapping_size();
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd == -1) return nullptr;
+
+    if (created) {
+        if (ftruncate(fd, mapping_size) == -1) {
+            close(fd);
+            shm_unlink(name);
+            return nullptr;
+        }
+    } else {
+        // A creator sizes the object right after creating it, so only an empty object is waited
+        // for, and only briefly, since this runs while the fonts load.
+        struct stat st;
+        for (int i = 0; i < kInitWaits; i++) {
+            if (fstat(fd, &st) == -1 || st.st_size != 0) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        // Larger objects may be laid out differently too, which the header tells.
+        if (size_t(st.st_size) < mapping_size) {
+            close(fd);
+            *stale = true;
+            return nullptr;
+        }
+    }
+
+    void* base = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return nullptr;
+
+    auto* header = static_cast<Header*>(base);
+    if (created) {
+        header->version = kVersion;
+        header->slot_count = kSlotCount;
+        header->max_probes = kMaxProbes;
+        header->arena_size = kArenaSize;
+        header->arena_used.store(0, std::memory_order_relaxed);
+        header->magic.store(kMagic, std::memory_order_release);
+    } else {
+        // Likewise the header is written right after sizing.
+        for (int i = 0; i < kInitWaits; i++) {
+            if (header->magic.load(std::memory_order_acquire) != 0) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (header->magic.load(std::memory_order_acquire) != kMagic ||
+            header->version != kVersion || header->slot_count != kSlotCount ||
+            header->arena_size != kArenaSize) {
+            munmap(base, mapping_size);
+            *stale = true;
+            return nullptr;
+        }
+    }
+
+    return new SharedGlyphCache(base, mapping_size);
+}
+
+SharedGlyphCache::SharedGlyphCache(void* base, size_t size) : base(base), size(size) {}
+
+SharedGlyphCache::~SharedGlyphCache() {
+    munmap(base, size);
+}
+
+SharedGlyphCache::Header* SharedGlyphCache::header() const {
+    return static_cast<Header*>(base);
+}
+
+SharedGlyphCache::Slot* SharedGlyphCache::slots() const {
+    return reinterpret_cast<Slot*>(static_cast<uint8_t*>(base) + sizeof(Header));
+}
+
+uint8_t* SharedGlyphCache::arena() const {
+    return reinterpret_cast<uint8_t*>(slots() + kSlotCount);
+}
+
+bool SharedGlyphCache::lookup(const GlyphKey& key, RasterizedGlyph* glyph) const {
+    uint64_t hash = hash_key(key);
+    for (uint32_t probe = 0; probe < kMaxProbes; probe++) {
+        Slot& slot = slots()[(hash + probe) & (kSlotCount - 1)];
+        uint32_t state = slot.state.load(std::memory_order_acquire);
+
+        // Slots are never released, so an empty slot ends the probe sequence.
+        if (state == kSlotEmpty) return false;
+        if (state != kSlotReady) continue;
+
+        GlyphKey slot_key{slot.font_hash, slot.glyph_id, slot.size, slot.subpixel_bin};
+        if (!(slot_key == key)) continue;
+
+        glyph->left = slot.left;
+        glyph->top = slot.top;
+        glyph->width = slot.width;
+        glyph->height = slot.height;
+        glyph->buffer = arena() + slot.offset;
+        return true;
+    }
+    return false;
+}
+
+bool SharedGlyphCache::insert(const GlyphKey& key, const RasterizedGlyph& glyph) {
+    // Keep bitmaps 8 byte aligned so copies out of the arena stay cheap.
+    uint64_t bytes = uint64_t(glyph.width) * glyph.height * 3;
+    uint64_t reserved = (bytes + 7) & ~uint64_t(7);
+    if (header()->arena_used.load(std::memory_order_relaxed) + reserved > kArenaSize) return false;
+
+    uint64_t hash = hash_key(key);
+
+    for (uint32_t probe = 0; probe < kMaxProbes; probe++) {
+        Slot& slot = slots()[(hash + probe) & (kSlotCount - 1)];
+
+        uint32_t expected = kSlotEmpty;
+        if (!slot.state.compare_exchange_strong(expected, kSlotWriting,
+                                                std::memory_order_acquire)) {
+            if (expected == kSlotReady) {
+                GlyphKey slot_key{slot.font_hash, slot.glyph_id, slot.size, slot.subpixel_bin};
+                if (slot_key == key) return true;
+            }
+            continue;
+        }
+
+        uint64_t offset = header()->arena_used.fetch_add(reserved, std::memory_order_relaxed);
+        if (offset + reserved > kArenaSize) {
+            // Another process filled the arena first; leave the slot claimed so probing continues
+            // past it.
+            return false;
+        }
+
+        memcpy(arena() + offset, glyph.buffer, bytes);
+        slot.glyph_id = key.glyph_id;
+        slot.font_hash = key.font_hash;
+        slot.size = key.size;
+        slot.subpixel_bin = key.subpixel_bin;
+        slot.left = glyph.left;
+        slot.top = glyph.top;
+        slot.width = glyph.width;
+        slot.height = glyph.height;
+        slot.offset = offset;
+        slot.state.store(kSlotReady, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
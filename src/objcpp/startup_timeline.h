@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+// When each startup phase finished, on the thread that ran it, measured from the first recorded
+// phase. Safe to call from any thread.
+void record_startup_phase(const char* thread, const char* phase);
+
+// Prints every phase recorded so far, in order, with the time each one took on its thread. Only
+// the first call prints.
+void print_startup_timeline();
+
+// Microseconds since the first recorded phase.
+uint64_t startup_elapsed_us();
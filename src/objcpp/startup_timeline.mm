@@ -0,0 +1,88 @@
+#import "startup_timeline.h"
+#import "renderer.h"
+#import <algorithm>
+#import <chrono>
+#import <iomanip>
+#import <iostream>
+#import <mutex>
+#import <string>
+#import <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Phase {
+    std::string thread;
+    std::string name;
+    uint64_t end_us;
+};
+
+struct Timeline {
+    std::mutex mutex;
+    Clock::time_point origin;
+    bool started = false;
+    bool printed = false;
+    std::vector<Phase> phases;
+};
+
+Timeline& timeline() {
+    static Timeline timeline;
+    return timeline;
+}
+
+uint64_t elapsed_us(const Timeline& timeline) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                                          timeline.origin)
+                        .count());
+}
+
+}
+
+void record_startup_phase(const char* thread, const char* phase) {
+    Timeline& timeline = ::timeline();
+    std::lock_guard lock(timeline.mutex);
+    if (!timeline.started) {
+        timeline.origin = Clock::now();
+        timeline.started = true;
+    }
+    timeline.phases.push_back(Phase{thread, phase, elapsed_us(timeline)});
+}
+
+void mark_startup_phase(const char* phase) {
+    record_startup_phase("main", phase);
+}
+
+uint64_t startup_elapsed_us() {
+    Timeline& timeline = ::timeline();
+    std::lock_guard lock(timeline.mutex);
+    return timeline.started ? elapsed_us(timeline) : 0;
+}
+
+void print_startup_timeline() {
+    Timeline& timeline = ::timeline();
+    std::lock_guard lock(timeline.mutex);
+    if (timeline.printed) return;
+    timeline.printed = true;
+
+    std::vector<Phase> phases = timeline.phases;
+    std::stable_sort(phases.begin(), phases.end(),
+                     [](const Phase& a, const Phase& b) { return a.end_us < b.end_us; });
+
+    // A phase took from the end of the previous phase on its thread to its own end; the main
+    // thread's phases are the critical path.
+    std::cout << "startup timeline:\n" << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < phases.size(); i++) {
+        uint64_t start_us = 0;
+        for (size_t j = i; j-- > 0;) {
+            if (phases[j].thread == phases[i].thread) {
+                start_us = phases[j].end_us;
+                break;
+            }
+        }
+        std::cout << std::right << std::setw(10) << phases[i].end_us / 1000.0 << "ms  "
+                  << std::left << std::setw(8) << phases[i].thread << std::setw(24)
+                  << phases[i].name << std::right << std::setw(8)
+                  << (phases[i].end_us - start_us) / 1000.0 << "ms\n";
+    }
+}
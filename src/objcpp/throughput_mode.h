@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Decides how soon the next frame is drawn from the rate output arrives at.
+//
+// Normally every change is drawn as soon as possible. Once output arrives faster than anyone can
+// read it for a sustained stretch, frames are only drawn every `kThroughputInterval`, or as soon
+// as the output pauses, so parsing is not held up by frames that would only show intermediate
+// states. The mode ends on its own once the output slows down again.
+class ThroughputMode {
+public:
+    ThroughputMode();
+
+    // Records `bytes` of output arriving now.
+    void record_input(size_t bytes);
+    void frame_drawn();
+
+    // Microseconds the next frame should be put off by, zero when it should be drawn now.
+    uint64_t frame_delay_us();
+
+    bool active() const {
+        return throughput;
+    }
+
+    // Times the mode was entered or left, and frames put off while it was active.
+    uint64_t switches() const {
+        return switch_count;
+    }
+
+    uint64_t deferred_frames() const {
+        return deferred_count;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Closes every rate window that ended before `now`.
+    void advance(Clock::time_point now);
+
+    Clock::time_point window_start;
+    size_t window_bytes = 0;
+    // Consecutive windows at or above the rate that enters the mode.
+    int busy_windows = 0;
+    bool throughput = false;
+
+    Clock::time_point last_input;
+    Clock::time_point last_frame;
+
+    uint64_t switch_count = 0;
+    uint64_t deferred_count = 0;
+};
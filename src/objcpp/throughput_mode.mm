@@ -0,0 +1,82 @@
+#import "throughput_mode.h"
+#import <algorithm>
+
+namespace {
+
+using namespace std::chrono_literals;
+
+// Input rate is measured over windows this long.
+constexpr auto kRateWindow = 50ms;
+constexpr uint64_t kWindowsPerSecond = 1s / kRateWindow;
+
+// Entered after this many consecutive windows at 2 MiB/s or more, left after a single window
+// below 256 KiB/s. The gap keeps bursty output from switching modes every window.
+constexpr int kSustainedWindows = 2;
+constexpr uint64_t kEnterBytesPerSecond = 2 << 20;
+constexpr uint64_t kLeaveBytesPerSecond = 256 << 10;
+
+// Frame interval during floods, about 30 frames per second.
+constexpr auto kThroughputInterval = 33ms;
+// A pause this long in the output is drawn right away, since it is likely the final state.
+constexpr auto kQuiescence = 8ms;
+
+uint64_t to_us(std::chrono::steady_clock::duration duration) {
+    return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+}
+
+}
+
+ThroughputMode::ThroughputMode()
+    : window_start(Clock::now()), last_input(window_start), last_frame(window_start) {}
+
+void ThroughputMode::record_input(size_t bytes) {
+    Clock::time_point now = Clock::now();
+    advance(now);
+    window_bytes += bytes;
+    last_input = now;
+}
+
+void ThroughputMode::frame_drawn() {
+    last_frame = Clock::now();
+}
+
+uint64_t ThroughputMode::frame_delay_us() {
+    Clock::time_point now = Clock::now();
+    advance(now);
+    if (!throughput) return 0;
+
+    auto since_frame = now - last_frame;
+    auto since_input = now - last_input;
+    if (since_frame >= kThroughputInterval || since_input >= kQuiescence) return 0;
+
+    deferred_count++;
+    return to_us(std::min<Clock::duration>(kThroughputInterval - since_frame,
+                                           kQuiescence - since_input));
+}
+
+void ThroughputMode::advance(Clock::time_point now) {
+    while (now - window_start >= kRateWindow) {
+        uint64_t rate = window_bytes * kWindowsPerSecond;
+        busy_windows = rate >= kEnterBytesPerSecond ? busy_windows + 1 : 0;
+        if (!throughput && busy_windows >= kSustainedWindows) {
+            throughput = true;
+            switch_count++;
+        } else if (throughput && rate < kLeaveBytesPerSecond) {
+            throughput = false;
+            switch_count++;
+        }
+
+        window_start += kRateWindow;
+        window_bytes = 0;
+
+        // Any further elapsed windows saw no input at all.
+        if (now - window_start >= kRateWindow) {
+            busy_windows = 0;
+            if (throughput) {
+                throughput = false;
+                switch_count++;
+            }
+            window_start = now;
+        }
+    }
+}
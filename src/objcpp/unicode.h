@@ -0,0 +1,76 @@
+#pragma once
+
+#include "unicode_tables.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Grapheme_Cluster_Break property values, in the order build.rs encodes them.
+enum class GraphemeBreak : uint8_t {
+    kOther,
+    kCR,
+    kLF,
+    kControl,
+    kExtend,
+    kZWJ,
+    kRegionalIndicator,
+    kPrepend,
+    kSpacingMark,
+    kL,
+    kV,
+    kT,
+    kLV,
+    kLVT,
+};
+
+// Width, grapheme break property and Extended_Pictographic of `c`, packed as build.rs describes.
+// Three dependent loads into about 19 KiB of tables, without branches.
+inline uint8_t char_properties(char32_t c) {
+    using namespace unicode_tables;
+    // Malformed input past U+10FFFF is treated like a noncharacter.
+    c = std::min<char32_t>(c, 0x10FFFF);
+    return kLeaf[kMid[kTop[c >> 12]][(c >> 6) & 63]][c & 63];
+}
+
+// Cells taken by `c`: 2 for East Asian wide and fullwidth characters, 0 for characters that join
+// the previous cell or are not printed.
+inline int char_width(char32_t c) {
+    return char_properties(c) & 3;
+}
+
+inline GraphemeBreak grapheme_break(char32_t c) {
+    return GraphemeBreak((char_properties(c) >> 2) & 15);
+}
+
+inline bool is_extended_pictographic(char32_t c) {
+    return char_properties(c) & 64;
+}
+
+// Number of leading printable ASCII characters (U+0020 to U+007E), which are all one cell wide
+// and never join their neighbors, found without touching the tables.
+size_t printable_ascii_prefix(const char32_t* text, size_t size);
+
+// Writes the width of every code point in `text` to `widths`, skipping the table lookups for
+// printable ASCII runs.
+void char_widths(const char32_t* text, size_t size, uint8_t* widths);
+
+// Finds extended grapheme cluster boundaries (UAX #29) one code point at a time.
+class GraphemeBreaker {
+public:
+    // Returns true when `c` starts a new cluster rather than extending the current one.
+    bool starts_cluster(char32_t c);
+
+    void reset() {
+        *this = GraphemeBreaker();
+    }
+
+private:
+    bool first = true;
+    GraphemeBreak previous = GraphemeBreak::kOther;
+
+    // Regional indicators pair up into flags, so the parity of the current run matters.
+    bool odd_regional_indicators = false;
+    // Inside an Extended_Pictographic Extend* sequence, and right after its ZWJ.
+    bool in_pictographic = false;
+    bool after_pictographic_zwj = false;
+};
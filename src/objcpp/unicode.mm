@@ -0,0 +1,85 @@
+#import "unicode.h"
+#import <cstring>
+
+#if defined(__ARM_NEON)
+#import <arm_neon.h>
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#endif
+
+size_t printable_ascii_prefix(const char32_t* text, size_t size) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 4 <= size; i += 4) {
+        uint32x4_t v = vld1q_u32(reinterpret_cast<const uint32_t*>(text + i));
+        uint32x4_t printable = vandq_u32(vcgeq_u32(v, vdupq_n_u32(0x20)),
+                                         vcleq_u32(v, vdupq_n_u32(0x7E)));
+        if (vminvq_u32(printable) == 0) break;
+    }
+#elif defined(__SSE2__)
+    // Code points are at most 0x10FFFF, so signed comparisons are enough.
+    const __m128i low = _mm_set1_epi32(0x1F);
+    const __m128i high = _mm_set1_epi32(0x7F);
+    for (; i + 4 <= size; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi32(v, low), _mm_cmplt_epi32(v, high));
+        if (_mm_movemask_epi8(printable) != 0xFFFF) break;
+    }
+#endif
+    while (i < size && text[i] >= 0x20 && text[i] <= 0x7E) i++;
+    return i;
+}
+
+void char_widths(const char32_t* text, size_t size, uint8_t* widths) {
+    size_t i = 0;
+    while (i < size) {
+        size_t ascii = printable_ascii_prefix(text + i, size - i);
+        memset(widths + i, 1, ascii);
+        i += ascii;
+
+        // Table lookups until the next printable ASCII character.
+        for (; i < size && (text[i] < 0x20 || text[i] > 0x7E); i++) {
+            widths[i] = char_width(text[i]);
+        }
+    }
+}
+
+bool GraphemeBreaker::starts_cluster(char32_t c) {
+    GraphemeBreak current = grapheme_break(c);
+    bool pictographic = is_extended_pictographic(c);
+
+    bool boundary;
+    using B = GraphemeBreak;
+    if (first) {
+        boundary = true;
+    } else if (previous == B::kCR && current == B::kLF) {
+        boundary = false;
+    } else if (previous == B::kControl || previous == B::kCR || previous == B::kLF ||
+               current == B::kControl || current == B::kCR || current == B::kLF) {
+        boundary = true;
+    } else if (previous == B::kL && (current == B::kL || current == B::kV ||
+                                     current == B::kLV || current == B::kLVT)) {
+        boundary = false;
+    } else if ((previous == B::kLV || previous == B::kV) &&
+               (current == B::kV || current == B::kT)) {
+        boundary = false;
+    } else if ((previous == B::kLVT || previous == B::kT) && current == B::kT) {
+        boundary = false;
+    } else if (current == B::kExtend || current == B::kZWJ || current == B::kSpacingMark ||
+               previous == B::kPrepend) {
+        boundary = false;
+    } else if (after_pictographic_zwj && pictographic) {
+        boundary = false;
+    } else if (previous == B::kRegionalIndicator && current == B::kRegionalIndicator) {
+        boundary = !odd_regional_indicators;
+    } else {
+        boundary = true;
+    }
+
+    after_pictographic_zwj = in_pictographic && current == B::kZWJ;
+    in_pictographic = pictographic || (in_pictographic && current == B::kExtend);
+    odd_regional_indicators = current == B::kRegionalIndicator && !odd_regional_indicators;
+    previous = current;
+    first = false;
+    return boundary;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Returns true when `data` is entirely valid UTF-8, checking 16 bytes at a time with the lookup
+// table algorithm of Keiser and Lemire where SSSE3 or NEON is available.
+bool validate_utf8(const uint8_t* data, size_t size);
+
+// Converts a stream of UTF-8 chunks into code points.
+//
+// Each chunk is validated as a whole first. Valid chunks are transcoded without further checks,
+// widening ASCII and four 3-byte sequences at a time in vector registers, so CJK text costs
+// about as much as ASCII. Chunks with errors are decoded one sequence at a time instead, with
+// U+FFFD for every maximal invalid subpart.
+class Utf8Decoder {
+public:
+    // Appends the code points in `data` to `out`. A sequence cut off at the end of the chunk is
+    // completed with the start of the next one.
+    void decode(const uint8_t* data, size_t size, std::vector<char32_t>* out);
+
+private:
+    uint8_t pending[4];
+    size_t pending_size = 0;
+};
@@ -0,0 +1,371 @@
+#import "utf8.h"
+#import "renderer.h"
+#import <algorithm>
+#import <cstring>
+
+#if defined(__ARM_NEON)
+#import <arm_neon.h>
+#elif defined(__SSSE3__)
+#import <tmmintrin.h>
+#endif
+
+namespace {
+
+constexpr char32_t kReplacement = 0xFFFD;
+
+// Length of the sequence starting with `lead`, or zero when it cannot start one.
+size_t sequence_length(uint8_t lead) {
+    if (lead < 0x80) return 1;
+    if (lead < 0xC2) return 0;
+    if (lead < 0xE0) return 2;
+    if (lead < 0xF0) return 3;
+    if (lead < 0xF5) return 4;
+    return 0;
+}
+
+// Start of a sequence whose lead byte is among the last three bytes but which needs more bytes
+// than `size` leaves it, or `size` when there is none.
+size_t open_sequence_start(const uint8_t* data, size_t size) {
+    for (size_t back = 1; back <= 3 && back <= size; back++) {
+        uint8_t byte = data[size - back];
+        if ((byte & 0xC0) == 0x80) continue;
+        return sequence_length(byte) > back ? size - back : size;
+    }
+    return size;
+}
+
+// Bounds of the second byte, which also rule out overlong forms, surrogates and code points past
+// U+10FFFF.
+bool valid_second_byte(uint8_t lead, uint8_t byte) {
+    switch (lead) {
+    case 0xE0:
+        return byte >= 0xA0 && byte <= 0xBF;
+    case 0xED:
+        return byte >= 0x80 && byte <= 0x9F;
+    case 0xF0:
+        return byte >= 0x90 && byte <= 0xBF;
+    case 0xF4:
+        return byte >= 0x80 && byte <= 0x8F;
+    default:
+        return byte >= 0x80 && byte <= 0xBF;
+    }
+}
+
+// Decodes one sequence at `data`. Returns the bytes consumed, or zero when `size` ends in the
+// middle of a sequence that is valid so far. Invalid sequences decode to U+FFFD and set
+// `invalid`, since the input may also contain U+FFFD itself.
+size_t decode_checked(const uint8_t* data, size_t size, char32_t* out, bool* invalid) {
+    uint8_t lead = data[0];
+    size_t length = sequence_length(lead);
+    if (length == 1) {
+        *out = lead;
+        return 1;
+    }
+    if (length == 0) {
+        *out = kReplacement;
+        *invalid = true;
+        return 1;
+    }
+
+    char32_t c = lead & (0xFF >> (length + 1));
+    for (size_t i = 1; i < length; i++) {
+        if (i == size) return 0;
+        uint8_t byte = data[i];
+        bool valid = i == 1 ? valid_second_byte(lead, byte) : (byte & 0xC0) == 0x80;
+        if (!valid) {
+            // The bytes so far are one maximal invalid subpart.
+            *out = kReplacement;
+            *invalid = true;
+            return i;
+        }
+        c = (c << 6) | (byte & 0x3F);
+    }
+    *out = c;
+    return length;
+}
+
+void decode_scalar(const uint8_t* data, size_t size, std::vector<char32_t>* out) {
+    size_t i = 0;
+    while (i < size) {
+        char32_t c;
+        bool invalid = false;
+        size_t consumed = decode_checked(data + i, size - i, &c, &invalid);
+        if (consumed == 0) {
+            c = kReplacement;
+            consumed = size - i;
+        }
+        out->push_back(c);
+        i += consumed;
+    }
+}
+
+// Decodes data already known to be valid.
+void decode_valid(const uint8_t* data, size_t size, std::vector<char32_t>* out) {
+    size_t start = out->size();
+    // Never more code points than bytes, plus room for whole vector stores.
+    out->resize(start + size + 16);
+    char32_t* dest = out->data() + start;
+
+    size_t i = 0;
+    while (i < size) {
+#if defined(__ARM_NEON) || defined(__SSSE3__)
+        if (i + 16 <= size) {
+#if defined(__ARM_NEON)
+            uint8x16_t v = vld1q_u8(data + i);
+            bool ascii = vmaxvq_u8(v) < 0x80;
+#else
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            bool ascii = _mm_movemask_epi8(v) == 0;
+#endif
+            if (ascii) {
+                for (int k = 0; k < 16; k++) dest[k] = data[i + k];
+                dest += 16;
+                i += 16;
+                continue;
+            }
+
+            // Four 3-byte sequences in the first 12 bytes, gathered into one lane each with the
+            // lead byte in bits 16-23.
+#if defined(__ARM_NEON)
+            const uint8_t gather[16] = {2, 1, 0, 0xFF, 5, 4, 3, 0xFF,
+                                        8, 7, 6, 0xFF, 11, 10, 9, 0xFF};
+            uint32x4_t lanes = vreinterpretq_u32_u8(vqtbl1q_u8(v, vld1q_u8(gather)));
+            uint32x4_t matches =
+                vceqq_u32(vandq_u32(lanes, vdupq_n_u32(0xF0C0C0)), vdupq_n_u32(0xE08080));
+            if (vminvq_u32(matches) != 0) {
+                uint32x4_t c = vorrq_u32(
+                    vorrq_u32(vandq_u32(lanes, vdupq_n_u32(0x3F)),
+                              vandq_u32(vshrq_n_u32(lanes, 2), vdupq_n_u32(0xFC0))),
+                    vandq_u32(vshrq_n_u32(lanes, 4), vdupq_n_u32(0xF000)));
+                vst1q_u32(reinterpret_cast<uint32_t*>(dest), c);
+                dest += 4;
+                i += 12;
+                continue;
+            }
+#else
+            const __m128i gather = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10,
+                                                 9, -1);
+            __m128i lanes = _mm_shuffle_epi8(v, gather);
+            __m128i matches = _mm_cmpeq_epi32(_mm_and_si128(lanes, _mm_set1_epi32(0xF0C0C0)),
+                                              _mm_set1_epi32(0xE08080));
+            if (_mm_movemask_epi8(matches) == 0xFFFF) {
+                __m128i c = _mm_or_si128(
+                    _mm_or_si128(
+                        _mm_and_si128(lanes, _mm_set1_epi32(0x3F)),
+                        _mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xFC0))),
+                    _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xF000)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), c);
+                dest += 4;
+                i += 12;
+                continue;
+            }
+#endif
+        }
+#endif
+
+        uint8_t lead = data[i];
+        if (lead < 0x80) {
+            *dest++ = lead;
+            i += 1;
+        } else if (lead < 0xE0) {
+            *dest++ = (char32_t(lead & 0x1F) << 6) | (data[i + 1] & 0x3F);
+            i += 2;
+        } else if (lead < 0xF0) {
+            *dest++ = (char32_t(lead & 0x0F) << 12) | (char32_t(data[i + 1] & 0x3F) << 6) |
+                      (data[i + 2] & 0x3F);
+            i += 3;
+        } else {
+            *dest++ = (char32_t(lead & 0x07) << 18) | (char32_t(data[i + 1] & 0x3F) << 12) |
+                      (char32_t(data[i + 2] & 0x3F) << 6) | (data[i + 3] & 0x3F);
+            i += 4;
+        }
+    }
+
+    out->resize(dest - out->data());
+}
+
+#if defined(__ARM_NEON) || defined(__SSSE3__)
+
+// Error classes of a byte pair, set in the tables below when the pair could be one.
+constexpr uint8_t kTooShort = 1 << 0;  // Lead byte followed by ASCII or another lead.
+constexpr uint8_t kTooLong = 1 << 1;   // ASCII followed by a continuation byte.
+constexpr uint8_t kOverlong3 = 1 << 2; // 11100000 100_____
+constexpr uint8_t kTooLarge = 1 << 3;  // 11110100 1001____ and above.
+constexpr uint8_t kSurrogate = 1 << 4; // 11101101 101_____
+constexpr uint8_t kOverlong2 = 1 << 5; // 1100000_ 10______
+constexpr uint8_t kTooLarge1000 = 1 << 6; // 11110101 1000____ and above.
+constexpr uint8_t kOverlong4 = 1 << 6;    // 11110000 1000____
+constexpr uint8_t kTwoConts = 1 << 7;     // Continuation byte after a continuation byte.
+constexpr uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+// Indexed by the high nibble of the first byte of a pair.
+alignas(16) constexpr uint8_t kByte1High[16] = {
+    kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+    kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+    kTooShort | kOverlong2,
+    kTooShort,
+    kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4,
+};
+
+// Indexed by the low nibble of the first byte.
+alignas(16) constexpr uint8_t kByte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+};
+
+// Indexed by the high nibble of the second byte.
+alignas(16) constexpr uint8_t kByte2High[16] = {
+    kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort, kTooShort, kTooShort, kTooShort,
+};
+
+#endif
+
+}
+
+bool validate_utf8(const uint8_t* data, size_t size) {
+    // The last bytes are checked as one more block padded with zeros. Padding is ASCII, so it
+    // flags sequences still open at the end of the data.
+    size_t full = size - size % 16;
+    alignas(16) uint8_t last[16] = {};
+    if (size > full) memcpy(last, data + full, size - full);
+
+#if defined(__ARM_NEON)
+    uint8x16_t previous = vdupq_n_u8(0);
+    uint8x16_t error = vdupq_n_u8(0);
+    const uint8x16_t byte_1_high = vld1q_u8(kByte1High);
+    const uint8x16_t byte_1_low = vld1q_u8(kByte1Low);
+    const uint8x16_t byte_2_high = vld1q_u8(kByte2High);
+    auto check = [&](uint8x16_t input) {
+        uint8x16_t prev1 = vextq_u8(previous, input, 15);
+        uint8x16_t special = vandq_u8(
+            vandq_u8(vqtbl1q_u8(byte_1_high, vshrq_n_u8(prev1, 4)),
+                     vqtbl1q_u8(byte_1_low, vandq_u8(prev1, vdupq_n_u8(0x0F)))),
+            vqtbl1q_u8(byte_2_high, vshrq_n_u8(input, 4)));
+
+        // Third and fourth bytes of a sequence have to be continuation bytes.
+        uint8x16_t prev2 = vextq_u8(previous, input, 14);
+        uint8x16_t prev3 = vextq_u8(previous, input, 13);
+        uint8x16_t must_continue = vandq_u8(
+            vorrq_u8(vqsubq_u8(prev2, vdupq_n_u8(0xE0 - 0x80)),
+                     vqsubq_u8(prev3, vdupq_n_u8(0xF0 - 0x80))),
+            vdupq_n_u8(0x80));
+        error = vorrq_u8(error, veorq_u8(special, must_continue));
+        previous = input;
+    };
+
+    for (size_t i = 0; i < full; i += 16) check(vld1q_u8(data + i));
+    check(vld1q_u8(last));
+    return vmaxvq_u8(error) == 0;
+#elif defined(__SSSE3__)
+    __m128i previous = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    const __m128i byte_1_high = _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1High));
+    const __m128i byte_1_low = _mm_load_si128(reinterpret_cast<const __m128i*>(kByte1Low));
+    const __m128i byte_2_high = _mm_load_si128(reinterpret_cast<const __m128i*>(kByte2High));
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+    auto check = [&](__m128i input) {
+        __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+        // There is no 8-bit shift; the bits shifted in from the neighbor byte are masked off.
+        __m128i special = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(byte_1_high,
+                                 _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble)),
+                _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, low_nibble))),
+            _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble)));
+
+        // Third and fourth bytes of a sequence have to be continuation bytes.
+        __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+        __m128i must_continue = _mm_and_si128(
+            _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(char(0xE0 - 0x80))),
+                         _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xF0 - 0x80)))),
+            _mm_set1_epi8(char(0x80)));
+        error = _mm_or_si128(error, _mm_xor_si128(special, must_continue));
+        previous = input;
+    };
+
+    for (size_t i = 0; i < full; i += 16) {
+        check(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+    }
+    check(_mm_load_si128(reinterpret_cast<const __m128i*>(last)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+#else
+    size_t i = 0;
+    while (i < size) {
+        char32_t c;
+        bool invalid = false;
+        size_t consumed = decode_checked(data + i, size - i, &c, &invalid);
+        if (consumed == 0 || invalid) return false;
+        i += consumed;
+    }
+    return true;
+#endif
+}
+
+void Utf8Decoder::decode(const uint8_t* data, size_t size, std::vector<char32_t>* out) {
+    // Finish the sequence left over from the previous chunk, taking bytes from this one as it
+    // needs them. Bytes after an invalid subpart are decoded again from the pending buffer, since
+    // some of them may have come from the previous chunk.
+    while (pending_size > 0) {
+        char32_t c;
+        bool invalid = false;
+        size_t consumed = decode_checked(pending, pending_size, &c, &invalid);
+        if (consumed == 0) {
+            if (size == 0) return;
+            pending[pending_size++] = *data++;
+            size--;
+            continue;
+        }
+        out->push_back(c);
+        pending_size -= consumed;
+        memmove(pending, pending + consumed, pending_size);
+    }
+
+    // Keep a sequence cut off at the end for the next chunk.
+    size_t end = open_sequence_start(data, size);
+
+    if (validate_utf8(data, end)) {
+        decode_valid(data, end, out);
+    } else {
+        decode_scalar(data, end, out);
+    }
+
+    for (size_t i = end; i < size; i++) pending[pending_size++] = data[i];
+}
+
+size_t decode_utf8(const uint8_t* data, const size_t* chunk_sizes, size_t chunk_count,
+                   uint32_t* out, size_t capacity) {
+    Utf8Decoder decoder;
+    std::vector<char32_t> decoded;
+    for (size_t i = 0; i < chunk_count; i++) {
+        // Each chunk gets a buffer of its own, as reads into it do, so stepping outside the chunk
+        // is an out-of-bounds access rather than a read of its neighbor.
+        std::vector<uint8_t> chunk(data, data + chunk_sizes[i]);
+        decoder.decode(chunk.data(), chunk.size(), &decoded);
+        data += chunk_sizes[i];
+    }
+
+    size_t count = std::min(decoded.size(), capacity);
+    std::copy(decoded.begin(), decoded.begin() + count, out);
+    return decoded.size();
+}
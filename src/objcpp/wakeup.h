@@ -0,0 +1,4 @@
+#pragma once
+
+// Asks the event loop to redraw; safe to call from any thread.
+void wake_event_loop();
@@ -0,0 +1,20 @@
+#import "wakeup.h"
+#import "renderer.h"
+#import <atomic>
+
+namespace {
+
+std::atomic<void (*)(void*)> wakeup_callback{nullptr};
+std::atomic<void*> wakeup_data{nullptr};
+
+}
+
+void set_wakeup_callback(void (*callback)(void* data), void* data) {
+    wakeup_data.store(data, std::memory_order_relaxed);
+    wakeup_callback.store(callback, std::memory_order_release);
+}
+
+void wake_event_loop() {
+    void (*callback)(void*) = wakeup_callback.load(std::memory_order_acquire);
+    if (callback) callback(wakeup_data.load(std::memory_order_relaxed));
+}